@@ -20,6 +20,7 @@ size_t fnv1a_hash(const char *key) {
 void hashmap_create(struct hashmap *self) {
   self->size = 1;
   self->count = 0;
+  self->stats = NULL;
   self->bucket_array = calloc(self->size, sizeof(struct hashmap_bucket *));
   assert(self->bucket_array);
 }
@@ -89,11 +90,28 @@ union hashmap_val_union *hashmap_get(const struct hashmap *self,
   size_t hash = fnv1a_hash(key);
   size_t index = hash % self->size;
   struct hashmap_bucket *b = self->bucket_array[index];
-  while (b) {
-    if (strcmp(b->key, key) == 0) {
-      return &b->data;
+  size_t probes = 0;
+  while (b && strcmp(b->key, key)) {
+    ++probes;
+    b = b->next;
+  }
+  if (self->stats) {
+    probes += b != NULL;
+    self->stats->lookups++;
+    self->stats->probes += probes;
+    if (probes > self->stats->max_probes) {
+      self->stats->max_probes = probes;
     }
+    self->stats->misses += b == NULL;
+  }
+  return b ? &b->data : NULL;
+}
+
+const char *hashmap_key(const struct hashmap *self, const char *key) {
+  size_t index = fnv1a_hash(key) % self->size;
+  struct hashmap_bucket *b = self->bucket_array[index];
+  while (b && strcmp(b->key, key)) {
     b = b->next;
   }
-  return NULL;
+  return b ? b->key : NULL;
 }
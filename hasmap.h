@@ -15,10 +15,19 @@ struct hashmap_bucket {
   struct hashmap_bucket *next;
 };
 
+// lookup counters, only maintained when a hashmap points to one
+struct hashmap_stats {
+  size_t lookups;
+  size_t probes; // buckets compared, over all lookups
+  size_t max_probes;
+  size_t misses;
+};
+
 struct hashmap {
   struct hashmap_bucket **bucket_array;
   size_t size;
   size_t count;
+  struct hashmap_stats *stats; // NULL by default
 };
 
 void hashmap_create(struct hashmap *self);
@@ -26,5 +35,9 @@ void hashmap_destroy(struct hashmap *self);
 bool hashmap_set(struct hashmap *self, char *key, union hashmap_val_union data);
 union hashmap_val_union *hashmap_get(const struct hashmap *self,
                                      const char *key);
+// the pointer stored as key for an equal key, the map does not copy its
+// keys so it may belong to whoever set the key first, NULL if there is none,
+// not counted in the stats
+const char *hashmap_key(const struct hashmap *self, const char *key);
 
 #endif // ifndef HASHMAP_H
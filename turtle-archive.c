@@ -0,0 +1,350 @@
+#include "turtle-output.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bits of the hash of the 4-byte sequences looked up by the compressor
+#define ARCHIVE_HASH_BITS 14
+// shortest match worth a back-reference
+#define ARCHIVE_MIN_MATCH 4
+// farthest back-reference, offsets are written on 16 bits
+#define ARCHIVE_MAX_OFFSET 65535
+// bound on the quantized values, beyond the coordinates are clamped, the
+// difference of two of them fits in an int64_t
+#define ARCHIVE_QUANTUM_LIMIT 2305843009213693952.0
+
+// state of the turtle at the start of a block, and where to find it
+struct archive_entry {
+  uint64_t offset;       // in the file
+  uint32_t size;         // compressed
+  uint32_t raw_size;     // once decompressed
+  uint64_t first_record; // records before the block
+  uint64_t first_step;   // moves and lines before the block
+  int64_t x;             // position, quantized
+  int64_t y;
+  int64_t color[3]; // current color, quantized
+};
+
+struct output_archive {
+  struct output base;
+  FILE *file;
+  bool close_file;
+  uint64_t offset; // bytes written so far
+
+  uint8_t *raw; // the current block before compression
+  size_t raw_size;
+  size_t raw_capacity;
+  size_t block_records;
+  uint8_t *packed;
+  size_t packed_capacity;
+  uint32_t hash[1 << ARCHIVE_HASH_BITS];
+
+  // state after the last record
+  int64_t x;
+  int64_t y;
+  int64_t color[3];
+  uint64_t records;
+  uint64_t steps;
+
+  struct archive_entry current; // the block being filled
+  struct archive_entry *entries;
+  size_t entries_count;
+  size_t entries_capacity;
+};
+
+static int64_t archive_quantize(double v) {
+  double q = round(v * OUTPUT_ARCHIVE_SCALE);
+  if (isnan(q)) {
+    return 0;
+  }
+  q = fmin(fmax(q, -ARCHIVE_QUANTUM_LIMIT), ARCHIVE_QUANTUM_LIMIT);
+  return (int64_t)q;
+}
+
+/*
+ * block encoding
+ */
+
+static uint8_t *archive_reserve(struct output_archive *self, size_t size) {
+  if (self->raw_size + size > self->raw_capacity) {
+    self->raw_capacity = self->raw_capacity ? self->raw_capacity * 2 : 4096;
+    self->raw = realloc(self->raw, self->raw_capacity);
+  }
+  return self->raw + self->raw_size;
+}
+
+static void archive_byte(struct output_archive *self, uint8_t v) {
+  *archive_reserve(self, 1) = v;
+  self->raw_size++;
+}
+
+// zig-zag then LEB128, small deltas of either sign take one or two bytes
+static void archive_varint(struct output_archive *self, int64_t v) {
+  uint64_t u = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+  uint8_t *p = archive_reserve(self, 10);
+  size_t len = 0;
+  while (u >= 0x80) {
+    p[len++] = (uint8_t)(u | 0x80);
+    u >>= 7;
+  }
+  p[len++] = (uint8_t)u;
+  self->raw_size += len;
+}
+
+/*
+ * compression
+ *
+ * LZ77 with the sequence layout of LZ4: a token holding the length of the
+ * literals in the high nibble and the length of the match minus 4 in the
+ * low nibble, 15 meaning that 255-terminated bytes follow, the literals,
+ * then the offset of the match on 16 bits, little-endian, and the rest of
+ * its length. The last sequence has only literals.
+ */
+
+// room needed to compress size bytes in the worst case
+static size_t archive_compress_bound(size_t size) {
+  return size + size / 255 + 16;
+}
+
+static uint32_t archive_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static size_t archive_length(uint8_t *dst, size_t len) {
+  size_t out = 0;
+  for (; len >= 255; len -= 255) {
+    dst[out++] = 255;
+  }
+  dst[out++] = (uint8_t)len;
+  return out;
+}
+
+static size_t archive_sequence(uint8_t *dst, const uint8_t *literals,
+                               size_t literals_len, size_t offset,
+                               size_t match_len) {
+  size_t out = 1;
+  uint8_t token = (uint8_t)((literals_len < 15 ? literals_len : 15) << 4);
+  if (literals_len >= 15) {
+    out += archive_length(dst + out, literals_len - 15);
+  }
+  memcpy(dst + out, literals, literals_len);
+  out += literals_len;
+  if (match_len > 0) {
+    size_t len = match_len - ARCHIVE_MIN_MATCH;
+    token |= len < 15 ? len : 15;
+    dst[out++] = (uint8_t)offset;
+    dst[out++] = (uint8_t)(offset >> 8);
+    if (len >= 15) {
+      out += archive_length(dst + out, len - 15);
+    }
+  }
+  dst[0] = token;
+  return out;
+}
+
+// greedy parse with the last position of each hashed 4-byte sequence
+static size_t archive_compress(const uint8_t *src, size_t size, uint8_t *dst,
+                               uint32_t *hash) {
+  memset(hash, 0, sizeof(uint32_t) << ARCHIVE_HASH_BITS);
+  size_t out = 0;
+  size_t anchor = 0;
+  size_t i = 0;
+  while (i + ARCHIVE_MIN_MATCH <= size) {
+    uint32_t seq = archive_read32(src + i);
+    uint32_t h = (seq * 2654435761u) >> (32 - ARCHIVE_HASH_BITS);
+    size_t candidate = hash[h];
+    hash[h] = (uint32_t)i + 1; // 0 for an empty slot
+    if (candidate == 0 || i - (candidate - 1) > ARCHIVE_MAX_OFFSET ||
+        archive_read32(src + candidate - 1) != seq) {
+      ++i;
+      continue;
+    }
+    size_t match = candidate - 1;
+    size_t len = ARCHIVE_MIN_MATCH;
+    while (i + len < size && src[match + len] == src[i + len]) {
+      ++len;
+    }
+    out +=
+        archive_sequence(dst + out, src + anchor, i - anchor, i - match, len);
+    i += len;
+    anchor = i;
+  }
+  out += archive_sequence(dst + out, src + anchor, size - anchor, 0, 0);
+  return out;
+}
+
+/*
+ * file layout
+ */
+
+static void archive_write(struct output_archive *self, const void *data,
+                          size_t size) {
+  fwrite(data, 1, size, self->file);
+  self->offset += size;
+  self->base.bytes = self->offset;
+}
+
+static void archive_put32(struct output_archive *self, uint32_t v) {
+  uint8_t buf[4];
+  for (int i = 0; i < 4; ++i) {
+    buf[i] = (uint8_t)(v >> (8 * i));
+  }
+  archive_write(self, buf, sizeof(buf));
+}
+
+static void archive_put64(struct output_archive *self, uint64_t v) {
+  uint8_t buf[8];
+  for (int i = 0; i < 8; ++i) {
+    buf[i] = (uint8_t)(v >> (8 * i));
+  }
+  archive_write(self, buf, sizeof(buf));
+}
+
+static void archive_flush_block(struct output_archive *self) {
+  if (self->block_records == 0) {
+    return;
+  }
+  size_t bound = archive_compress_bound(self->raw_size);
+  if (bound > self->packed_capacity) {
+    self->packed_capacity = bound;
+    self->packed = realloc(self->packed, bound);
+  }
+  size_t size =
+      archive_compress(self->raw, self->raw_size, self->packed, self->hash);
+
+  self->current.offset = self->offset;
+  self->current.size = (uint32_t)size;
+  self->current.raw_size = (uint32_t)self->raw_size;
+  archive_write(self, self->packed, size);
+
+  if (self->entries_count == self->entries_capacity) {
+    self->entries_capacity =
+        self->entries_capacity ? self->entries_capacity * 2 : 64;
+    self->entries = realloc(self->entries, self->entries_capacity *
+                                               sizeof(struct archive_entry));
+  }
+  self->entries[self->entries_count++] = self->current;
+  self->raw_size = 0;
+  self->block_records = 0;
+}
+
+static void output_archive_emit(struct output *base,
+                                const struct output_record *rec) {
+  struct output_archive *self = (struct output_archive *)base;
+  if (self->block_records == 0) {
+    self->current.first_record = self->records;
+    self->current.first_step = self->steps;
+    self->current.x = self->x;
+    self->current.y = self->y;
+    memcpy(self->current.color, self->color, sizeof(self->color));
+  }
+
+  archive_byte(self, (uint8_t)rec->kind);
+  switch (rec->kind) {
+  case OUTPUT_MOVE_TO:
+  case OUTPUT_LINE_TO: {
+    int64_t x = archive_quantize(rec->u.point.x);
+    int64_t y = archive_quantize(rec->u.point.y);
+    archive_varint(self, x - self->x);
+    archive_varint(self, y - self->y);
+    self->x = x;
+    self->y = y;
+    self->steps++;
+    break;
+  }
+  case OUTPUT_COLOR: {
+    int64_t color[3] = {
+        archive_quantize(rec->u.color.r),
+        archive_quantize(rec->u.color.g),
+        archive_quantize(rec->u.color.b),
+    };
+    for (int i = 0; i < 3; ++i) {
+      archive_varint(self, color[i] - self->color[i]);
+      self->color[i] = color[i];
+    }
+    break;
+  }
+  }
+  self->records++;
+
+  if (++self->block_records == OUTPUT_ARCHIVE_BLOCK_RECORDS) {
+    archive_flush_block(self);
+  }
+}
+
+static bool output_archive_finish(struct output *base) {
+  struct output_archive *self = (struct output_archive *)base;
+  archive_flush_block(self);
+
+  uint64_t index = self->offset;
+  for (size_t i = 0; i < self->entries_count; ++i) {
+    const struct archive_entry *e = &self->entries[i];
+    archive_put64(self, e->offset);
+    archive_put32(self, e->size);
+    archive_put32(self, e->raw_size);
+    archive_put64(self, e->first_record);
+    archive_put64(self, e->first_step);
+    archive_put64(self, (uint64_t)e->x);
+    archive_put64(self, (uint64_t)e->y);
+    for (int c = 0; c < 3; ++c) {
+      archive_put64(self, (uint64_t)e->color[c]);
+    }
+  }
+  archive_put64(self, index);
+  archive_put64(self, self->entries_count);
+  archive_put64(self, self->records);
+  archive_put64(self, self->steps);
+  archive_write(self, OUTPUT_ARCHIVE_INDEX_MAGIC, 8);
+
+  bool ok = !ferror(self->file);
+  if (self->close_file) {
+    ok = fclose(self->file) == 0 && ok;
+    self->file = NULL;
+  } else {
+    ok = fflush(self->file) == 0 && ok;
+  }
+  return ok;
+}
+
+static void output_archive_destroy(struct output *base) {
+  struct output_archive *self = (struct output_archive *)base;
+  if (self->close_file && self->file) {
+    fclose(self->file);
+  }
+  free(self->raw);
+  free(self->packed);
+  free(self->entries);
+  free(self);
+}
+
+struct output *output_archive_create(const char *path) {
+  FILE *file = stdout;
+  bool close_file = false;
+  if (strcmp(path, "-") != 0) {
+    file = fopen(path, "wb");
+    if (!file) {
+      perror(path);
+      return NULL;
+    }
+    close_file = true;
+  }
+
+  struct output_archive *self = calloc(1, sizeof(struct output_archive));
+  self->base.emit = output_archive_emit;
+  self->base.finish = output_archive_finish;
+  self->base.destroy = output_archive_destroy;
+  self->base.next = NULL;
+  self->file = file;
+  self->close_file = close_file;
+
+  archive_write(self, OUTPUT_ARCHIVE_MAGIC, 8);
+  archive_put32(self, OUTPUT_ARCHIVE_VERSION);
+  archive_put32(self, OUTPUT_ARCHIVE_BLOCK_RECORDS);
+  return &self->base;
+}
@@ -1,7 +1,12 @@
 #include "turtle-ast.h"
 #include "hasmap.h"
+#include "turtle-budget.h"
+#include "turtle-instance.h"
+#include "turtle-jit.h"
+#include "turtle-metrics.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
@@ -122,24 +127,44 @@ struct ast_node *make_cmd_block(struct ast_node *block) {
   return node;
 }
 
-void ast_node_destroy(struct ast_node *self) {
+static void ast_node_destroy_one(struct ast_node *self) {
   if (self->kind == KIND_CMD_PROC || self->kind == KIND_CMD_SET ||
       self->kind == KIND_CMD_CALL || self->kind == KIND_EXPR_NAME) {
     free(self->u.name);
   }
   for (size_t i = 0; i < self->children_count; ++i) {
-    ast_node_destroy(self->children[i]);
-    free(self->children[i]);
+    if (self->children[i]) {
+      ast_node_destroy(self->children[i]);
+      free(self->children[i]);
+    }
   }
-  if (self->next) {
-    ast_node_destroy(self->next);
-    free(self->next);
+}
+
+void ast_node_destroy(struct ast_node *self) {
+  // a sequence may be as long as the program, it is freed in a loop
+  struct ast_node *next = self->next;
+  ast_node_destroy_one(self);
+  while (next) {
+    struct ast_node *node = next;
+    next = node->next;
+    ast_node_destroy_one(node);
+    free(node);
   }
 }
 
+void ast_create(struct ast *self) {
+  self->unit = NULL;
+  self->last = NULL;
+  self->stream = NULL;
+  self->optimize = false;
+  self->slots = 0;
+}
+
 void ast_destroy(struct ast *self) {
-  ast_node_destroy(self->unit);
-  free(self->unit);
+  if (self->unit) {
+    ast_node_destroy(self->unit);
+    free(self->unit);
+  }
 }
 
 /*
@@ -154,18 +179,196 @@ void context_create(struct context *self) {
   self->up = false;
   self->angle = 0;
   self->error = false;
+  self->out = output_text_create(stdout);
+  self->metrics = NULL;
+  self->log = stderr;
+  self->jit = jit_create();
+  self->instances = NULL;
+  self->stats = NULL;
+  self->threads = 1;
+  self->budget = NULL;
+  self->budget_nodes_left = 0;
+  self->budget_segments_left = 0;
+  self->call_depth = 0;
+  self->caches = NULL;
+  self->caches_size = 0;
 }
 
 void context_destroy(struct context *self) {
   hashmap_destroy(&self->variables);
   hashmap_destroy(&self->procedures);
+  output_destroy(self->out);
+  jit_destroy(self->jit);
+  instances_destroy(self->instances);
+  free(self->caches);
+}
+
+void context_set_output(struct context *self, struct output *out) {
+  output_destroy(self->out);
+  self->out = out;
+}
+
+static void context_emit_point(struct context *self, enum output_kind kind) {
+  if (self->budget && kind == OUTPUT_LINE_TO) {
+    if (self->budget_segments_left == 0 && !budget_segments(self)) {
+      return;
+    }
+    self->budget_segments_left--;
+  }
+  struct output_record rec;
+  rec.kind = kind;
+  rec.u.point.x = self->x;
+  rec.u.point.y = self->y;
+  if (self->metrics) {
+    self->metrics->records++;
+  }
+  output_emit(self->out, &rec);
+}
+
+// emit the current position, drawing a line unless the pen is up
+static void context_emit_move(struct context *self) {
+  context_emit_point(self, self->up ? OUTPUT_MOVE_TO : OUTPUT_LINE_TO);
+}
+
+void context_home(struct context *self) {
+  self->up = false;
+  self->x = 0;
+  self->y = 0;
+  self->angle = 0;
+  context_emit_point(self, OUTPUT_MOVE_TO);
+}
+
+void context_forward(struct context *self, double d) {
+  self->x -= d * sin(self->angle * PI / 180.0);
+  self->y -= d * cos(self->angle * PI / 180.0);
+  context_emit_move(self);
+}
+
+void context_backward(struct context *self, double d) {
+  self->x += d * sin(self->angle * PI / 180.0);
+  self->y += d * cos(self->angle * PI / 180.0);
+  context_emit_move(self);
+}
+
+void context_position(struct context *self, double x, double y) {
+  self->x = x;
+  self->y = y;
+  context_emit_move(self);
+}
+
+void context_color(struct context *self, double r, double g, double b) {
+  struct output_record rec;
+  rec.kind = OUTPUT_COLOR;
+  rec.u.color.r = r;
+  rec.u.color.g = g;
+  rec.u.color.b = b;
+  if (self->metrics) {
+    self->metrics->records++;
+  }
+  output_emit(self->out, &rec);
+}
+
+int context_repeat_count(struct context *self, double count) {
+  if (isnan(count) || count >= INT_MAX + 1.0) {
+    fprintf(self->log, "invalid repeat count %lf\n", count);
+    self->error = true;
+    return 0;
+  }
+  return count > 0 ? (int)count : 0;
+}
+
+static struct context_cache *context_cache(struct context *self,
+                                           size_t slot) {
+  if (slot >= self->caches_size) {
+    size_t size = self->caches_size ? self->caches_size : 16;
+    while (slot >= size) {
+      size *= 2;
+    }
+    self->caches = realloc(self->caches, size * sizeof(struct context_cache));
+    memset(&self->caches[self->caches_size], 0,
+           (size - self->caches_size) * sizeof(struct context_cache));
+    self->caches_size = size;
+  }
+  return &self->caches[slot];
+}
+
+void context_cache_reset(struct context *self, size_t first, size_t count) {
+  for (size_t i = first; i < first + count && i < self->caches_size; ++i) {
+    self->caches[i].valid = false;
+  }
 }
 
 /*
  * eval
  */
 
-double ast_node_eval(const struct ast_node *self, struct context *ctx) {
+double ast_node_eval(const struct ast_node *self, struct context *ctx);
+
+// whether every run of the node draws the same thing relative to the state
+// of the turtle it starts from: no variable set, no procedure called, no
+// random value, no absolute move and nothing printed
+static bool ast_node_relative(const struct ast_node *self) {
+  switch (self->kind) {
+  case KIND_CMD_SET:
+  case KIND_CMD_CALL:
+  case KIND_CMD_PROC:
+    return false;
+  case KIND_CMD_SIMPLE:
+    if (self->u.cmd == CMD_HEADING || self->u.cmd == CMD_POSITION ||
+        self->u.cmd == CMD_HOME || self->u.cmd == CMD_PRINT) {
+      return false;
+    }
+    break;
+  case KIND_EXPR_FUNC:
+    if (self->u.func == FUNC_RANDOM) {
+      return false;
+    }
+    break;
+  default:
+    break;
+  }
+  for (size_t i = 0; i < self->children_count; ++i) {
+    for (const struct ast_node *n = self->children[i]; n; n = n->next) {
+      if (!ast_node_relative(n)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// with --stats, run the body once and account for the other iterations in
+// closed form when they are copies of the first one moved by the same
+// translation, false if they have to be evaluated
+static bool ast_repeat_closed_form(const struct ast_node *self,
+                                   struct context *ctx, int count) {
+  double x = ctx->x;
+  double y = ctx->y;
+  double angle = ctx->angle;
+  bool up = ctx->up;
+
+  output_stats_span_begin(ctx->stats);
+  ast_node_eval(self->children[1], ctx);
+  if (ctx->error) {
+    output_stats_span_end(ctx->stats, 1, 0, 0);
+    return true;
+  }
+
+  double dx = ctx->x - x;
+  double dy = ctx->y - y;
+  double turn = ctx->angle - angle;
+  bool same = ctx->up == up && fmod(turn, 360) == 0;
+  if (!output_stats_span_end(ctx->stats, same ? count : 1, dx, dy) || !same) {
+    return false;
+  }
+  ctx->x = x + count * dx;
+  ctx->y = y + count * dy;
+  ctx->angle = angle + count * turn;
+  return true;
+}
+
+static double ast_node_eval_kind(const struct ast_node *self,
+                                 struct context *ctx) {
   switch (self->kind) {
   case KIND_CMD_SET: {
     union hashmap_val_union val;
@@ -177,25 +380,65 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
   }
 
   case KIND_CMD_REPEAT: {
-    int val = ast_node_eval(self->children[0], ctx);
+    int val = context_repeat_count(ctx, ast_node_eval(self->children[0], ctx));
     if (ctx->error)
       return NAN;
-    for (int i = 0; i < val; ++i) {
-      ast_node_eval(self->children[1], ctx);
+    context_cache_reset(ctx, self->u.caches.first, self->u.caches.count);
+    int i = 0;
+    // the closed form does not go through the nodes the budget counts
+    if (ctx->stats && !ctx->budget && val > 1 &&
+        ast_node_relative(self->children[1])) {
+      if (ast_repeat_closed_form(self, ctx, val)) {
+        break;
+      }
+      i = 1;
+    } else if (ctx->threads > 1 && !ctx->metrics && !ctx->budget &&
+               val >= AST_SCAN_MIN_COUNT &&
+               ast_node_relative(self->children[1])) {
+      i = ast_repeat_scan(self, ctx, val);
       if (ctx->error)
         return NAN;
     }
+    ast_repeat_iterate(self, ctx, val - i);
+    if (ctx->error)
+      return NAN;
     break;
   }
 
   case KIND_CMD_CALL: {
     union hashmap_val_union *proc = hashmap_get(&ctx->procedures, self->u.name);
     if (!proc) {
-      fprintf(stderr, "unknown procedure %s\n", self->u.name);
+      fprintf(ctx->log, "unknown procedure %s\n", self->u.name);
       ctx->error = true;
       return NAN;
     }
-    ast_node_eval(proc->ast_node, ctx);
+    if (ctx->budget && !budget_enter(ctx)) {
+      return NAN;
+    }
+    struct metrics *metrics = ctx->metrics;
+    double start = 0;
+    if (metrics) {
+      metrics->call_depth++;
+      if (metrics->call_depth > metrics->max_call_depth) {
+        metrics->max_call_depth = metrics->call_depth;
+      }
+      if (metrics->call_depth == 1 && metrics->trace) {
+        start = metrics_now();
+      }
+    }
+    if (!ctx->instances ||
+        !instances_call(ctx->instances, proc->ast_node, ctx)) {
+      ast_node_eval(proc->ast_node, ctx);
+    }
+    if (metrics) {
+      if (metrics->call_depth == 1 && metrics->trace) {
+        metrics_trace(metrics, "call", self->u.name, start, metrics_now());
+      }
+      metrics->call_depth--;
+    }
+    if (ctx->budget) {
+      ctx->call_depth--;
+    }
     if (ctx->error)
       return NAN;
     break;
@@ -223,11 +466,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       break;
 
     case CMD_HOME:
-      ctx->up = false;
-      ctx->x = 0;
-      ctx->y = 0;
-      ctx->angle = 0;
-      fprintf(stdout, "MoveTo %lf %lf\n", ctx->x, ctx->y);
+      context_home(ctx);
       break;
 
     case CMD_LEFT:
@@ -246,13 +485,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       double d = ast_node_eval(self->children[0], ctx);
       if (ctx->error)
         return NAN;
-      ctx->x -= d * sin(ctx->angle * PI / 180.0);
-      ctx->y -= d * cos(ctx->angle * PI / 180.0);
-      if (ctx->up) {
-        fprintf(stdout, "MoveTo %lf %lf\n", ctx->x, ctx->y);
-      } else {
-        fprintf(stdout, "LineTo %lf %lf\n", ctx->x, ctx->y);
-      }
+      context_forward(ctx, d);
       break;
     }
 
@@ -260,13 +493,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       double d = ast_node_eval(self->children[0], ctx);
       if (ctx->error)
         return NAN;
-      ctx->x += d * sin(ctx->angle * PI / 180.0);
-      ctx->y += d * cos(ctx->angle * PI / 180.0);
-      if (ctx->up) {
-        fprintf(stdout, "MoveTo %lf %lf\n", ctx->x, ctx->y);
-      } else {
-        fprintf(stdout, "LineTo %lf %lf\n", ctx->x, ctx->y);
-      }
+      context_backward(ctx, d);
       break;
     }
 
@@ -277,24 +504,21 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       break;
 
     case CMD_PRINT:
-      fprintf(stderr, "%lf\n", ast_node_eval(self->children[0], ctx));
+      fprintf(ctx->log, "%lf\n", ast_node_eval(self->children[0], ctx));
       if (ctx->error)
         return NAN;
       break;
 
-    case CMD_POSITION:
-      ctx->x = ast_node_eval(self->children[0], ctx);
+    case CMD_POSITION: {
+      double x = ast_node_eval(self->children[0], ctx);
       if (ctx->error)
         return NAN;
-      ctx->y = ast_node_eval(self->children[1], ctx);
+      double y = ast_node_eval(self->children[1], ctx);
       if (ctx->error)
         return NAN;
-      if (ctx->up) {
-        fprintf(stdout, "MoveTo %lf %lf\n", ctx->x, ctx->y);
-      } else {
-        fprintf(stdout, "LineTo %lf %lf\n", ctx->x, ctx->y);
-      }
+      context_position(ctx, x, y);
       break;
+    }
 
     case CMD_COLOR: {
       double r = ast_node_eval(self->children[0], ctx);
@@ -306,7 +530,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       double b = ast_node_eval(self->children[2], ctx);
       if (ctx->error)
         return NAN;
-      fprintf(stdout, "Color %lf %lf %lf\n", r, g, b);
+      context_color(ctx, r, g, b);
       break;
     }
     }
@@ -318,7 +542,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
   case KIND_EXPR_NAME: {
     union hashmap_val_union *val = hashmap_get(&ctx->variables, self->u.name);
     if (!val) {
-      fprintf(stderr, "unknown variable %s\n", self->u.name);
+      fprintf(ctx->log, "unknown variable %s\n", self->u.name);
       ctx->error = true;
       return NAN;
     }
@@ -342,7 +566,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       return rhs - lhs;
     case '/':
       if (lhs==0){
-        fprintf(stderr, "You can't divide by 0");
+        fprintf(ctx->log, "You can't divide by 0");
         ctx->error = true;
         return NAN;
       }
@@ -357,6 +581,46 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
   case KIND_EXPR_BLOCK:
     return ast_node_eval(self->children[0], ctx);
 
+  case KIND_EXPR_INVARIANT: {
+    struct context_cache *cache = context_cache(ctx, self->u.cache.slot);
+    if (cache->valid) {
+      return cache->value;
+    }
+    double res = ast_node_eval(self->children[0], ctx);
+    if (ctx->error)
+      return NAN;
+    // the expression may have grown the caches
+    cache = context_cache(ctx, self->u.cache.slot);
+    cache->valid = true;
+    cache->value = res;
+    return res;
+  }
+
+  case KIND_EXPR_INDUCTION: {
+    double key = ast_node_eval(self->children[1], ctx);
+    if (ctx->error)
+      return NAN;
+    // integers below the limit keep every step exact
+    bool exact = key == trunc(key) && fabs(key) < AST_INDUCTION_LIMIT;
+    struct context_cache *cache = context_cache(ctx, self->u.cache.slot);
+    double res;
+    if (exact && cache->valid &&
+        (res = cache->value + self->u.cache.coef * (key - cache->key)) != 0) {
+      // zero is left to the expression for its sign
+      cache->key = key;
+      cache->value = res;
+      return res;
+    }
+    res = ast_node_eval(self->children[0], ctx);
+    if (ctx->error)
+      return NAN;
+    cache = context_cache(ctx, self->u.cache.slot);
+    cache->valid = exact;
+    cache->key = key;
+    cache->value = res;
+    return res;
+  }
+
   case KIND_EXPR_FUNC:
     switch (self->u.func) {
     case FUNC_SIN:
@@ -371,7 +635,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
         return NAN;
       double res = tan(x);
       if (isnan(res)) {
-        fprintf(stderr, "can't tan a multiple of pi/2 : %lf\n", x);
+        fprintf(ctx->log, "can't tan a multiple of pi/2 : %lf\n", x);
         ctx->error = true;
         return NAN;
       }
@@ -382,7 +646,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       if (ctx->error)
         return NAN;
       if (x < 0) {
-        fprintf(stderr, "can't take sqare root of negative number : %lf\n", x);
+        fprintf(ctx->log, "can't take sqare root of negative number : %lf\n", x);
         ctx->error = true;
         return NAN;
       }
@@ -397,7 +661,7 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
       if (ctx->error)
         return NAN;
       if (min >= max || isnan(min) || isnan(max)) {
-        fprintf(stderr, "invalid interval [%lf ; %lf]\n", min, max);
+        fprintf(ctx->log, "invalid interval [%lf ; %lf]\n", min, max);
         ctx->error = true;
         return NAN;
       }
@@ -405,15 +669,136 @@ double ast_node_eval(const struct ast_node *self, struct context *ctx) {
     }
     }
   }
-  if (self->next)
-    ast_node_eval(self->next, ctx);
   return NAN;
 }
 
+void ast_repeat_iterate(const struct ast_node *self, struct context *ctx,
+                        int count) {
+  for (int i = 0; i < count; ++i) {
+    // a hot body runs the remaining iterations as native code
+    if (ctx->jit && jit_repeat(ctx->jit, self, ctx, count - i)) {
+      return;
+    }
+    ast_node_eval(self->children[1], ctx);
+    if (ctx->error) {
+      return;
+    }
+  }
+}
+
+double ast_node_eval_one(const struct ast_node *self, struct context *ctx) {
+  // the budget is only looked at once per grant of nodes
+  if (ctx->budget) {
+    if (ctx->budget_nodes_left == 0 && !budget_nodes(ctx)) {
+      return NAN;
+    }
+    ctx->budget_nodes_left--;
+  }
+  struct metrics *metrics = ctx->metrics;
+  if (!metrics) {
+    return ast_node_eval_kind(self, ctx);
+  }
+  metrics->visits[self->kind]++;
+  if (++metrics->depth > metrics->max_depth) {
+    metrics->max_depth = metrics->depth;
+  }
+  double res = ast_node_eval_kind(self, ctx);
+  metrics->depth--;
+  return res;
+}
+
+double ast_node_eval(const struct ast_node *self, struct context *ctx) {
+  double res = ast_node_eval_one(self, ctx);
+  while (self->next && !ctx->error) {
+    self = self->next;
+    ast_node_eval_one(self, ctx);
+  }
+  return res;
+}
+
 void ast_eval(const struct ast *self, struct context *ctx) {
   ast_node_eval(self->unit, ctx);
 }
 
+/*
+ * stream
+ */
+
+// whether the context refers to the node or to one of its descendants:
+// procedures keep their definition, variables the name that created them
+static bool ast_node_referenced(const struct ast_node *self,
+                                const struct context *ctx) {
+  if (self->kind == KIND_CMD_PROC) {
+    return true;
+  }
+  if (self->kind == KIND_CMD_SET &&
+      hashmap_key(&ctx->variables, self->u.name) == self->u.name) {
+    return true;
+  }
+  for (size_t i = 0; i < self->children_count; ++i) {
+    for (const struct ast_node *n = self->children[i]; n; n = n->next) {
+      if (ast_node_referenced(n, ctx)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool ast_node_has_repeat(const struct ast_node *self) {
+  if (self->kind == KIND_CMD_REPEAT) {
+    return true;
+  }
+  for (size_t i = 0; i < self->children_count; ++i) {
+    for (const struct ast_node *n = self->children[i]; n; n = n->next) {
+      if (ast_node_has_repeat(n)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void ast_link(struct ast *self, struct ast_node *node) {
+  if (self->last) {
+    self->last->next = node;
+  } else {
+    self->unit = node;
+  }
+  self->last = node;
+}
+
+void ast_append(struct ast *self, struct ast_node *node) {
+  struct context *ctx = self->stream;
+  if (!ctx) {
+    ast_link(self, node);
+    return;
+  }
+
+  // after an error, the rest of the program is only parsed
+  size_t slots = self->slots;
+  if (!ctx->error) {
+    if (self->optimize) {
+      ast_optimize_node(self, node);
+    }
+    ast_node_eval_one(node, ctx);
+  }
+
+  if (ast_node_referenced(node, ctx)) {
+    ast_link(self, node);
+    return;
+  }
+
+  // the caches of the command are handed out again
+  context_cache_reset(ctx, slots, self->slots - slots);
+  self->slots = slots;
+  if (ctx->jit && ast_node_has_repeat(node)) {
+    jit_forget(ctx->jit);
+  }
+  ast_node_destroy(node);
+  free(node);
+}
+
 /*
  * print
  */
@@ -521,6 +906,10 @@ void ast_node_print(const struct ast_node *self) {
     ast_node_print(self->children[0]);
     printf(")");
     break;
+  case KIND_EXPR_INVARIANT:
+  case KIND_EXPR_INDUCTION:
+    ast_node_print(self->children[0]);
+    break;
   case KIND_EXPR_FUNC:
     switch (self->u.func) {
     case FUNC_SIN:
@@ -2,8 +2,10 @@
 #define TURTLE_AST_H
 
 #include "hasmap.h"
+#include "turtle-output.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
 
 // simple commands
 enum ast_cmd {
@@ -44,8 +46,16 @@ enum ast_kind {
   KIND_EXPR_BINOP,
   KIND_EXPR_BLOCK,
   KIND_EXPR_NAME,
+
+  // introduced by ast_optimize inside the repeat bodies
+  KIND_EXPR_INVARIANT, // computed once per entry in the loop
+  KIND_EXPR_INDUCTION, // updated from its last value and the variable
 };
 
+// the variable of an induction expression is updated incrementally while it
+// stays an integer below this magnitude, so that the result is exact
+#define AST_INDUCTION_LIMIT 2147483648.0
+
 #define AST_CHILDREN_MAX 3
 
 // a node in the abstract syntax tree
@@ -59,6 +69,16 @@ struct ast_node {
              // in expressions
     char *name; // kind == KIND_EXPR_NAME, the name of procedures and variables
     enum ast_func func; // kind == KIND_EXPR_FUNC, a function
+    struct {
+      size_t first; // kind == KIND_CMD_REPEAT, the caches of the invariant
+      size_t count; // expressions of the body, reset on each entry
+    } caches;
+    struct {
+      size_t slot; // kind == KIND_EXPR_INVARIANT or KIND_EXPR_INDUCTION, the
+                   // cache in the context
+      double coef; // kind == KIND_EXPR_INDUCTION, the coefficient of the
+                   // variable
+    } cache;
   } u;
 
   size_t children_count; // the number of children of the node
@@ -85,13 +105,38 @@ struct ast_node *make_cmd_repeat(struct ast_node *count,
                                  struct ast_node *block);
 struct ast_node *make_cmd_block(struct ast_node *block);
 
+struct context;
+
 // root of the abstract syntax tree
 struct ast {
   struct ast_node *unit;
+  struct ast_node *last; // the last top-level command, while parsing
+
+  // when set, each top-level command is evaluated as soon as it is parsed,
+  // then freed unless the context refers to it
+  struct context *stream;
+  bool optimize; // run ast_optimize on each command of the stream
+
+  size_t slots; // caches handed out by ast_optimize
 };
 
+// an empty tree, to be filled by yyparse
+void ast_create(struct ast *self);
 // do not forget to destroy properly! no leaks allowed!
 void ast_destroy(struct ast *self);
+// destroy the children of a node and the nodes that follow it
+void ast_node_destroy(struct ast_node *self);
+
+struct budget;
+struct jit;
+struct metrics;
+
+// a value computed by an optimized expression
+struct context_cache {
+  bool valid;
+  double key; // the value of the variable of an induction expression
+  double value;
+};
 
 // the execution context
 struct context {
@@ -103,11 +148,57 @@ struct context {
 
   struct hashmap procedures;
   struct hashmap variables;
+
+  struct output *out; // where the primitives go, text on stdout by default
+  struct metrics *metrics; // NULL unless the run is instrumented
+  FILE *log;               // print and error messages, stderr by default
+  struct jit *jit;         // compiled repeat bodies, NULL if disabled
+  struct instances *instances; // recorded procedure drawings, NULL unless
+                               // enabled
+  struct output *stats;    // with --stats, the stage of ctx->out that
+                           // repeats are accounted for in closed form
+  unsigned threads;        // for the long repeats that only move the
+                           // turtle, 1 to evaluate them in place
+
+  struct budget *budget;       // limits of the evaluation, NULL for none
+  size_t budget_nodes_left;    // taken from the budget, not evaluated yet
+  size_t budget_segments_left; // taken from the budget, not drawn yet
+  size_t call_depth;           // nested procedure calls, with a budget
+
+  struct context_cache *caches; // indexed by slot, grown on demand
+  size_t caches_size;
 };
 
 // create an initial context
 void context_create(struct context *self);
 void context_destroy(struct context *self);
+// replace the output chain, the context takes ownership of it
+void context_set_output(struct context *self, struct output *out);
+
+// move the turtle and emit the corresponding primitives
+void context_home(struct context *self);
+void context_forward(struct context *self, double d);
+void context_backward(struct context *self, double d);
+void context_position(struct context *self, double x, double y);
+void context_color(struct context *self, double r, double g, double b);
+
+// the iterations of a repeat from the value of its count, none if it is
+// not positive, an error if it is not a number or does not fit in an int
+int context_repeat_count(struct context *self, double count);
+
+// invalidate the caches of the invariant expressions of a loop
+void context_cache_reset(struct context *self, size_t first, size_t count);
+
+// fold the constant expressions and, in the repeat bodies, cache the
+// invariant expressions and update incrementally the affine expressions of
+// the variables stepped by a constant, the results are unchanged
+void ast_optimize(struct ast *self);
+// the same for one top-level command
+void ast_optimize_node(struct ast *self, struct ast_node *node);
+
+// add a top-level command at the end of the tree, or evaluate it right away
+// when streaming
+void ast_append(struct ast *self, struct ast_node *node);
 
 // print the tree as if it was a Turtle program
 void ast_print(const struct ast *self);
@@ -115,4 +206,30 @@ void ast_print(const struct ast *self);
 // evaluate the tree and generate some basic primitives
 void ast_eval(const struct ast *self, struct context *ctx);
 
+// evaluate the independent top-level sections of the tree on up to jobs
+// threads (0 for one per online processor), the output and the messages
+// are the same as with ast_eval, the tree is evaluated by ast_eval when
+// the context is measured by metrics or limited in bytes by its budget
+void ast_eval_parallel(const struct ast *self, struct context *ctx,
+                       unsigned jobs);
+
+// run count iterations of the body of a repeat node
+void ast_repeat_iterate(const struct ast_node *self, struct context *ctx,
+                        int count);
+
+// shorter repeat loops are run in place without walking their body, the
+// walk costs about one iteration
+#define AST_SCAN_MIN_COUNT 64
+
+// run a repeat node whose body only moves the turtle relative to its pose,
+// the poses are computed in place and the records of the iterations are
+// evaluated and formatted again on ctx->threads threads, with the same
+// output as in place, returns the iterations run, only the first one when
+// the loop draws too little
+int ast_repeat_scan(const struct ast_node *self, struct context *ctx,
+                    int count);
+
+// evaluate a node alone, without the commands that follow it
+double ast_node_eval_one(const struct ast_node *self, struct context *ctx);
+
 #endif /* TURTLE_AST_H */
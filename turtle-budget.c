@@ -0,0 +1,152 @@
+#include "turtle-budget.h"
+#include "turtle-ast.h"
+#include "turtle-instance.h"
+#include "turtle-jit.h"
+#include "turtle-metrics.h"
+#include "turtle-output.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+void budget_create(struct budget *self) {
+  self->max_nodes = 0;
+  self->max_segments = 0;
+  self->max_bytes = 0;
+  self->max_call_depth = 0;
+  self->timeout = 0;
+  self->deadline = 0;
+  self->nodes = 0;
+  self->segments = 0;
+  self->reason = BUDGET_RUNNING;
+}
+
+void budget_start(struct budget *self) {
+  self->deadline = self->timeout > 0 ? metrics_now() + self->timeout : 0;
+}
+
+void budget_attach(struct budget *self, struct context *ctx) {
+  ctx->budget = self;
+  ctx->budget_nodes_left = 0;
+  ctx->budget_segments_left = 0;
+  ctx->call_depth = 0;
+  jit_destroy(ctx->jit);
+  ctx->jit = NULL;
+  instances_destroy(ctx->instances);
+  ctx->instances = NULL;
+}
+
+// keep the first reason, the evaluations stop for it
+static void budget_stop(struct budget *self, enum budget_reason reason) {
+  int running = BUDGET_RUNNING;
+  __atomic_compare_exchange_n(&self->reason, &running, reason, false,
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+void budget_cancel(struct budget *self) {
+  budget_stop(self, BUDGET_CANCELLED);
+}
+
+enum budget_reason budget_reason(const struct budget *self) {
+  return __atomic_load_n(&self->reason, __ATOMIC_SEQ_CST);
+}
+
+// stop the evaluation of the context, the message is written once
+static bool budget_fail(struct context *ctx) {
+  const struct budget *self = ctx->budget;
+  ctx->budget_nodes_left = 0;
+  ctx->budget_segments_left = 0;
+  if (ctx->error) {
+    return false;
+  }
+
+  switch (budget_reason(self)) {
+  case BUDGET_RUNNING:
+    break;
+  case BUDGET_NODES:
+    fprintf(ctx->log, "stopped: more than %" PRIu64 " nodes evaluated\n",
+            self->max_nodes);
+    break;
+  case BUDGET_SEGMENTS:
+    fprintf(ctx->log, "stopped: more than %" PRIu64 " segments drawn\n",
+            self->max_segments);
+    break;
+  case BUDGET_BYTES:
+    fprintf(ctx->log, "stopped: more than %zu bytes written\n",
+            self->max_bytes);
+    break;
+  case BUDGET_CALL_DEPTH:
+    fprintf(ctx->log, "stopped: more than %zu nested calls\n",
+            self->max_call_depth);
+    break;
+  case BUDGET_DEADLINE:
+    fprintf(ctx->log, "stopped: more than %g s spent\n", self->timeout);
+    break;
+  case BUDGET_CANCELLED:
+    fprintf(ctx->log, "stopped: cancelled\n");
+    break;
+  }
+  ctx->error = true;
+  return false;
+}
+
+// what is shared by the contexts, looked at each time one takes a grant
+static bool budget_poll(struct context *ctx) {
+  struct budget *self = ctx->budget;
+  if (self->deadline > 0 && metrics_now() > self->deadline) {
+    budget_stop(self, BUDGET_DEADLINE);
+  }
+  if (self->max_bytes > 0 && output_bytes(ctx->out) > self->max_bytes) {
+    budget_stop(self, BUDGET_BYTES);
+  }
+  return budget_reason(self) == BUDGET_RUNNING;
+}
+
+// take up to BUDGET_GRANT units below max, 0 if there is none left
+static uint64_t budget_take(uint64_t *used, uint64_t max) {
+  if (max == 0) {
+    return BUDGET_GRANT;
+  }
+  uint64_t before = __atomic_fetch_add(used, BUDGET_GRANT, __ATOMIC_RELAXED);
+  if (before >= max) {
+    return 0;
+  }
+  return max - before < BUDGET_GRANT ? max - before : BUDGET_GRANT;
+}
+
+bool budget_nodes(struct context *ctx) {
+  struct budget *self = ctx->budget;
+  if (!budget_poll(ctx)) {
+    return budget_fail(ctx);
+  }
+  ctx->budget_nodes_left = budget_take(&self->nodes, self->max_nodes);
+  if (ctx->budget_nodes_left == 0) {
+    budget_stop(self, BUDGET_NODES);
+    return budget_fail(ctx);
+  }
+  return true;
+}
+
+bool budget_segments(struct context *ctx) {
+  struct budget *self = ctx->budget;
+  if (!budget_poll(ctx)) {
+    return budget_fail(ctx);
+  }
+  ctx->budget_segments_left =
+      budget_take(&self->segments, self->max_segments);
+  if (ctx->budget_segments_left == 0) {
+    budget_stop(self, BUDGET_SEGMENTS);
+    return budget_fail(ctx);
+  }
+  return true;
+}
+
+bool budget_enter(struct context *ctx) {
+  struct budget *self = ctx->budget;
+  if (self->max_call_depth > 0 && ctx->call_depth >= self->max_call_depth) {
+    budget_stop(self, BUDGET_CALL_DEPTH);
+    return budget_fail(ctx);
+  }
+  ctx->call_depth++;
+  return true;
+}
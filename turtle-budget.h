@@ -0,0 +1,69 @@
+#ifndef TURTLE_BUDGET_H
+#define TURTLE_BUDGET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct context;
+
+// nodes or segments a context takes from the budget at once, the deadline,
+// the cancellation and the bytes are looked at when it takes more
+#define BUDGET_GRANT 1024
+
+// why an evaluation is stopped
+enum budget_reason {
+  BUDGET_RUNNING,
+  BUDGET_NODES,
+  BUDGET_SEGMENTS,
+  BUDGET_BYTES,
+  BUDGET_CALL_DEPTH,
+  BUDGET_DEADLINE,
+  BUDGET_CANCELLED,
+};
+
+// limits on the evaluation of an untrusted program, shared by the contexts
+// evaluating it, possibly on several threads
+//
+// an evaluation stopped by its budget fails like on any other error, with
+// a message in the log of the context that stopped
+//
+// the contexts of a parallel evaluation share the limits in the order they
+// reach them, so the drawing may stop earlier in the program than with a
+// single context, a program with a limit on the bytes is evaluated on a
+// single thread since the sections only write their records once merged
+struct budget {
+  // the limits, 0 for none
+  uint64_t max_nodes;    // nodes evaluated
+  uint64_t max_segments; // lines drawn
+  size_t max_bytes;      // bytes written by the backends of the output
+  size_t max_call_depth; // nested procedure calls
+  double timeout;        // seconds after budget_start
+
+  // updated by the evaluation, atomically
+  double deadline;
+  uint64_t nodes;    // taken by the contexts, some maybe not evaluated yet
+  uint64_t segments; // the same for the lines
+  int reason;        // an enum budget_reason
+};
+
+// no limit until they are set
+void budget_create(struct budget *self);
+// start the clock of the timeout, before the evaluation
+void budget_start(struct budget *self);
+// evaluate the context within the budget, the JIT and the instancing are
+// not used then, since they do not go through every node
+void budget_attach(struct budget *self, struct context *ctx);
+
+// stop the evaluations at their next check, from any thread
+void budget_cancel(struct budget *self);
+enum budget_reason budget_reason(const struct budget *self);
+
+// called by the interpreter when the context used the nodes or the segments
+// it took, false if the evaluation has to stop, ctx->error is set then
+bool budget_nodes(struct context *ctx);
+bool budget_segments(struct context *ctx);
+// called for each procedure call, false if it is too deep
+bool budget_enter(struct context *ctx);
+
+#endif /* TURTLE_BUDGET_H */
@@ -0,0 +1,405 @@
+#include "turtle-instance.h"
+#include "hasmap.h"
+#include "turtle-ast.h"
+#include "turtle-metrics.h"
+#include "turtle-output.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PI 3.141592653589793
+
+// records kept for one procedure, beyond it is evaluated at each call
+#define INSTANCE_MAX_RECORDS 65536
+// distinct variables a procedure may read, their values are part of the key
+#define INSTANCE_MAX_NAMES 16
+
+// how the recorded drawing is moved to the pose of a call
+enum instance_frame {
+  INSTANCE_ROTATE,    // rotated by the heading, then translated
+  INSTANCE_TRANSLATE, // the body starts by setting the heading
+  INSTANCE_HEADING,   // the body sets the heading later, only replayed from
+                      // the heading it was recorded with
+};
+
+struct instance {
+  const struct ast_node *body;
+  bool eligible;
+  enum instance_frame frame;
+  const char *names[INSTANCE_MAX_NAMES]; // read by the body
+  size_t names_count;
+
+  // the state the drawing was recorded from
+  bool recorded;
+  union hashmap_val_union values[INSTANCE_MAX_NAMES];
+  bool up;
+  double angle;
+
+  // the state it leaves, in the frame of the entry
+  double exit_x;
+  double exit_y;
+  double exit_angle; // a turn for INSTANCE_ROTATE, absolute otherwise
+  bool exit_up;
+
+  // the records, the points in the frame of the entry
+  size_t count;
+  size_t capacity;
+  uint8_t *kinds;
+  double *xs;
+  double *ys;
+  size_t points_count;
+  double (*colors)[3];
+  size_t colors_count;
+  double *world_x; // the points of a replay
+  double *world_y;
+};
+
+struct instances {
+  struct instance **entries; // open addressing on the body address
+  size_t size;
+  size_t count;
+};
+
+struct instances *instances_create(void) {
+  struct instances *self = calloc(1, sizeof(struct instances));
+  self->size = 16;
+  self->entries = calloc(self->size, sizeof(struct instance *));
+  return self;
+}
+
+static void instance_clear(struct instance *inst) {
+  free(inst->kinds);
+  free(inst->xs);
+  free(inst->ys);
+  free(inst->colors);
+  free(inst->world_x);
+  free(inst->world_y);
+  inst->kinds = NULL;
+  inst->xs = inst->ys = inst->world_x = inst->world_y = NULL;
+  inst->colors = NULL;
+  inst->count = inst->capacity = 0;
+  inst->points_count = inst->colors_count = 0;
+  inst->recorded = false;
+}
+
+void instances_destroy(struct instances *self) {
+  if (!self) {
+    return;
+  }
+  for (size_t i = 0; i < self->size; ++i) {
+    if (self->entries[i]) {
+      instance_clear(self->entries[i]);
+      free(self->entries[i]);
+    }
+  }
+  free(self->entries);
+  free(self);
+}
+
+/*
+ * analysis
+ */
+
+// whether the drawing of the node only depends on the pose of the turtle and
+// on the variables it reads
+static bool instance_collect(struct instance *inst,
+                             const struct ast_node *node, bool *heading) {
+  switch (node->kind) {
+  case KIND_CMD_SET:
+  case KIND_CMD_CALL:
+  case KIND_CMD_PROC:
+    return false;
+
+  case KIND_CMD_SIMPLE:
+    if (node->u.cmd == CMD_POSITION || node->u.cmd == CMD_HOME ||
+        node->u.cmd == CMD_PRINT) {
+      return false;
+    }
+    if (node->u.cmd == CMD_HEADING) {
+      *heading = true;
+    }
+    break;
+
+  case KIND_EXPR_FUNC:
+    if (node->u.func == FUNC_RANDOM) {
+      return false;
+    }
+    break;
+
+  case KIND_EXPR_NAME: {
+    size_t i = 0;
+    while (i < inst->names_count && strcmp(inst->names[i], node->u.name)) {
+      ++i;
+    }
+    if (i == INSTANCE_MAX_NAMES) {
+      return false;
+    }
+    if (i == inst->names_count) {
+      inst->names[inst->names_count++] = node->u.name;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+
+  for (size_t i = 0; i < node->children_count; ++i) {
+    for (const struct ast_node *n = node->children[i]; n; n = n->next) {
+      if (!instance_collect(inst, n, heading)) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static void instance_analyze(struct instance *inst) {
+  bool heading = false;
+  inst->eligible = instance_collect(inst, inst->body, &heading);
+
+  const struct ast_node *first = inst->body;
+  while (first && first->kind == KIND_CMD_BLOCK) {
+    first = first->children[0];
+  }
+  if (!heading) {
+    inst->frame = INSTANCE_ROTATE;
+  } else if (first && first->kind == KIND_CMD_SIMPLE &&
+             first->u.cmd == CMD_HEADING) {
+    inst->frame = INSTANCE_TRANSLATE;
+  } else {
+    inst->frame = INSTANCE_HEADING;
+  }
+}
+
+static size_t instance_hash(const struct ast_node *node) {
+  return ((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+static struct instance *instance_get(struct instances *self,
+                                     const struct ast_node *body) {
+  if (2 * (self->count + 1) > self->size) {
+    struct instance **old = self->entries;
+    size_t old_size = self->size;
+    self->size *= 2;
+    self->entries = calloc(self->size, sizeof(struct instance *));
+    for (size_t i = 0; i < old_size; ++i) {
+      if (old[i]) {
+        size_t j = instance_hash(old[i]->body) & (self->size - 1);
+        while (self->entries[j]) {
+          j = (j + 1) & (self->size - 1);
+        }
+        self->entries[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  size_t i = instance_hash(body) & (self->size - 1);
+  while (self->entries[i] && self->entries[i]->body != body) {
+    i = (i + 1) & (self->size - 1);
+  }
+  if (!self->entries[i]) {
+    struct instance *inst = calloc(1, sizeof(struct instance));
+    inst->body = body;
+    instance_analyze(inst);
+    self->entries[i] = inst;
+    self->count++;
+  }
+  return self->entries[i];
+}
+
+/*
+ * recording
+ */
+
+// a stage put in front of the output during the first call, the records
+// still go through
+struct instance_recorder {
+  struct output base;
+  struct instance *inst;
+  double x; // pose of the entry
+  double y;
+  double cos;
+  double sin;
+  bool overflow;
+};
+
+static void instance_push(struct instance *inst, uint8_t kind) {
+  if (inst->count == inst->capacity) {
+    inst->capacity = inst->capacity ? 2 * inst->capacity : 64;
+    inst->kinds = realloc(inst->kinds, inst->capacity);
+    inst->xs = realloc(inst->xs, inst->capacity * sizeof(double));
+    inst->ys = realloc(inst->ys, inst->capacity * sizeof(double));
+    inst->colors = realloc(inst->colors, inst->capacity * sizeof(double[3]));
+  }
+  inst->kinds[inst->count++] = kind;
+}
+
+static void instance_recorder_emit(struct output *base,
+                                   const struct output_record *rec) {
+  struct instance_recorder *self = (struct instance_recorder *)base;
+  struct instance *inst = self->inst;
+  if (!self->overflow && inst->count == INSTANCE_MAX_RECORDS) {
+    self->overflow = true;
+  }
+  if (!self->overflow) {
+    instance_push(inst, (uint8_t)rec->kind);
+    if (rec->kind == OUTPUT_COLOR) {
+      double *color = inst->colors[inst->colors_count++];
+      color[0] = rec->u.color.r;
+      color[1] = rec->u.color.g;
+      color[2] = rec->u.color.b;
+    } else {
+      // the inverse of the rotation of instance_replay
+      double dx = rec->u.point.x - self->x;
+      double dy = rec->u.point.y - self->y;
+      inst->xs[inst->points_count] = self->cos * dx - self->sin * dy;
+      inst->ys[inst->points_count] = self->sin * dx + self->cos * dy;
+      inst->points_count++;
+    }
+  }
+  output_emit(self->base.next, rec);
+}
+
+static void instance_record(struct instance *inst,
+                            const struct ast_node *body,
+                            struct context *ctx) {
+  instance_clear(inst);
+  for (size_t i = 0; i < inst->names_count; ++i) {
+    union hashmap_val_union *val = hashmap_get(&ctx->variables, inst->names[i]);
+    if (val) {
+      inst->values[i] = *val;
+    }
+  }
+  inst->up = ctx->up;
+  inst->angle = ctx->angle;
+
+  struct instance_recorder recorder;
+  memset(&recorder, 0, sizeof(recorder));
+  recorder.base.emit = instance_recorder_emit;
+  recorder.base.next = ctx->out;
+  recorder.inst = inst;
+  recorder.x = ctx->x;
+  recorder.y = ctx->y;
+  recorder.cos = 1;
+  recorder.sin = 0;
+  if (inst->frame == INSTANCE_ROTATE) {
+    recorder.cos = cos(ctx->angle * PI / 180.0);
+    recorder.sin = sin(ctx->angle * PI / 180.0);
+  }
+
+  ctx->out = &recorder.base;
+  ast_node_eval_one(body, ctx);
+  ctx->out = recorder.base.next;
+
+  if (recorder.overflow) {
+    instance_clear(inst);
+    inst->eligible = false;
+    return;
+  }
+  if (ctx->error) {
+    instance_clear(inst);
+    return;
+  }
+
+  double dx = ctx->x - recorder.x;
+  double dy = ctx->y - recorder.y;
+  inst->exit_x = recorder.cos * dx - recorder.sin * dy;
+  inst->exit_y = recorder.sin * dx + recorder.cos * dy;
+  inst->exit_angle =
+      inst->frame == INSTANCE_ROTATE ? ctx->angle - inst->angle : ctx->angle;
+  inst->exit_up = ctx->up;
+  inst->world_x = malloc(inst->points_count * sizeof(double) + 1);
+  inst->world_y = malloc(inst->points_count * sizeof(double) + 1);
+  inst->recorded = true;
+}
+
+/*
+ * replay
+ */
+
+static bool instance_matches(const struct instance *inst,
+                             struct context *ctx) {
+  if (inst->up != ctx->up ||
+      (inst->frame == INSTANCE_HEADING && inst->angle != ctx->angle)) {
+    return false;
+  }
+  for (size_t i = 0; i < inst->names_count; ++i) {
+    union hashmap_val_union *val = hashmap_get(&ctx->variables, inst->names[i]);
+    if (!val || memcmp(val, &inst->values[i], sizeof(*val)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void instance_replay(struct instance *inst, struct context *ctx) {
+  double x = ctx->x;
+  double y = ctx->y;
+  size_t n = inst->points_count;
+  const double *restrict xs = inst->xs;
+  const double *restrict ys = inst->ys;
+  double *restrict wx = inst->world_x;
+  double *restrict wy = inst->world_y;
+
+  double c = 1;
+  double s = 0;
+  if (inst->frame == INSTANCE_ROTATE) {
+    c = cos(ctx->angle * PI / 180.0);
+    s = sin(ctx->angle * PI / 180.0);
+    for (size_t i = 0; i < n; ++i) {
+      wx[i] = x + c * xs[i] + s * ys[i];
+      wy[i] = y - s * xs[i] + c * ys[i];
+    }
+    ctx->angle += inst->exit_angle;
+  } else {
+    for (size_t i = 0; i < n; ++i) {
+      wx[i] = x + xs[i];
+      wy[i] = y + ys[i];
+    }
+    ctx->angle = inst->exit_angle;
+  }
+
+  struct output_record rec;
+  size_t point = 0;
+  size_t color = 0;
+  for (size_t i = 0; i < inst->count; ++i) {
+    rec.kind = (enum output_kind)inst->kinds[i];
+    if (rec.kind == OUTPUT_COLOR) {
+      rec.u.color.r = inst->colors[color][0];
+      rec.u.color.g = inst->colors[color][1];
+      rec.u.color.b = inst->colors[color][2];
+      color++;
+    } else {
+      rec.u.point.x = wx[point];
+      rec.u.point.y = wy[point];
+      point++;
+    }
+    output_emit(ctx->out, &rec);
+  }
+  if (ctx->metrics) {
+    ctx->metrics->records += inst->count;
+  }
+
+  ctx->x = x + c * inst->exit_x + s * inst->exit_y;
+  ctx->y = y - s * inst->exit_x + c * inst->exit_y;
+  ctx->up = inst->exit_up;
+}
+
+bool instances_call(struct instances *self, const struct ast_node *body,
+                    struct context *ctx) {
+  struct instance *inst = instance_get(self, body);
+  if (!inst->eligible) {
+    return false;
+  }
+  if (inst->recorded && instance_matches(inst, ctx)) {
+    instance_replay(inst, ctx);
+  } else {
+    instance_record(inst, body, ctx);
+  }
+  return true;
+}
@@ -0,0 +1,23 @@
+#ifndef TURTLE_INSTANCE_H
+#define TURTLE_INSTANCE_H
+
+#include <stdbool.h>
+
+struct ast_node;
+struct context;
+
+// the drawings of the procedures that only depend on the pose of the turtle
+// when they are called, recorded in the frame of the turtle on a first call
+// and replayed on the next ones with one rotation and one translation
+struct instances;
+
+struct instances *instances_create(void);
+void instances_destroy(struct instances *self);
+
+// called by the interpreter for each call of a procedure, evaluates or
+// replays the body and returns true, false if the interpreter has to
+// evaluate the body
+bool instances_call(struct instances *self, const struct ast_node *body,
+                    struct context *ctx);
+
+#endif /* TURTLE_INSTANCE_H */
@@ -0,0 +1,640 @@
+#define _DEFAULT_SOURCE
+#include "turtle-jit.h"
+#include "hasmap.h"
+#include "turtle-ast.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+// runs the body count times, returns non-zero if ctx->error was set
+typedef int (*jit_fn)(struct context *ctx, int64_t count);
+
+struct jit_entry {
+  const struct ast_node *node; // the repeat node, NULL for an empty slot
+  size_t runs;                 // interpreted iterations so far
+  jit_fn fn;
+  bool failed;
+};
+
+struct jit_region {
+  void *addr;
+  size_t len;
+};
+
+struct jit {
+  struct jit_entry *entries; // open addressing on the node address
+  size_t size;
+  size_t count;
+
+  struct jit_region *regions;
+  size_t regions_count;
+  size_t regions_capacity;
+};
+
+struct jit *jit_create(void) {
+  if (!JIT_SUPPORTED) {
+    return NULL;
+  }
+  struct jit *self = calloc(1, sizeof(struct jit));
+  self->size = 16;
+  self->entries = calloc(self->size, sizeof(struct jit_entry));
+  return self;
+}
+
+void jit_forget(struct jit *self) {
+#if JIT_SUPPORTED
+  for (size_t i = 0; i < self->regions_count; ++i) {
+    munmap(self->regions[i].addr, self->regions[i].len);
+  }
+#endif
+  self->regions_count = 0;
+  memset(self->entries, 0, self->size * sizeof(struct jit_entry));
+  self->count = 0;
+}
+
+void jit_destroy(struct jit *self) {
+  if (!self) {
+    return;
+  }
+  jit_forget(self);
+  free(self->regions);
+  free(self->entries);
+  free(self);
+}
+
+static size_t jit_hash(const struct ast_node *node) {
+  return ((uintptr_t)node >> 4) * 0x9E3779B97F4A7C15ULL;
+}
+
+static struct jit_entry *jit_entry(struct jit *self,
+                                   const struct ast_node *node) {
+  if (2 * (self->count + 1) > self->size) {
+    struct jit_entry *old = self->entries;
+    size_t old_size = self->size;
+    self->size *= 2;
+    self->entries = calloc(self->size, sizeof(struct jit_entry));
+    for (size_t i = 0; i < old_size; ++i) {
+      if (old[i].node) {
+        size_t j = jit_hash(old[i].node) & (self->size - 1);
+        while (self->entries[j].node) {
+          j = (j + 1) & (self->size - 1);
+        }
+        self->entries[j] = old[i];
+      }
+    }
+    free(old);
+  }
+
+  size_t i = jit_hash(node) & (self->size - 1);
+  while (self->entries[i].node && self->entries[i].node != node) {
+    i = (i + 1) & (self->size - 1);
+  }
+  if (!self->entries[i].node) {
+    self->entries[i].node = node;
+    self->count++;
+  }
+  return &self->entries[i];
+}
+
+#if JIT_SUPPORTED
+
+/*
+ * code generation, x86-64 System V
+ *
+ * rbx holds the context, the frame below the saved registers holds the
+ * loop counters and the temporaries of the expressions, each expression
+ * leaves its value in xmm0
+ */
+
+struct jit_code {
+  struct context *ctx;
+
+  uint8_t *buf;
+  size_t len;
+  size_t capacity;
+
+  int slots; // frame slots in use
+  int max_slots;
+
+  size_t *error_jumps; // rel32 fields to patch with the error exit
+  size_t error_count;
+  size_t error_capacity;
+};
+
+static void code_bytes(struct jit_code *c, const uint8_t *bytes, size_t n) {
+  if (c->len + n > c->capacity) {
+    c->capacity = c->capacity ? 2 * c->capacity : 4096;
+    while (c->len + n > c->capacity) {
+      c->capacity *= 2;
+    }
+    c->buf = realloc(c->buf, c->capacity);
+  }
+  memcpy(c->buf + c->len, bytes, n);
+  c->len += n;
+}
+
+#define CODE(c, ...)                                                           \
+  code_bytes((c), (const uint8_t[]){__VA_ARGS__},                             \
+             sizeof((const uint8_t[]){__VA_ARGS__}))
+
+static void code_u32(struct jit_code *c, uint32_t v) {
+  CODE(c, v, v >> 8, v >> 16, v >> 24);
+}
+
+static void code_u64(struct jit_code *c, uint64_t v) {
+  code_u32(c, v);
+  code_u32(c, v >> 32);
+}
+
+static void code_patch32(struct jit_code *c, size_t at, uint32_t v) {
+  c->buf[at] = v;
+  c->buf[at + 1] = v >> 8;
+  c->buf[at + 2] = v >> 16;
+  c->buf[at + 3] = v >> 24;
+}
+
+// point the rel32 field at the current position
+static void code_bind(struct jit_code *c, size_t field) {
+  code_patch32(c, field, (uint32_t)(c->len - (field + 4)));
+}
+
+static int32_t code_slot_disp(int slot) { return -24 - 8 * slot; }
+
+static int code_slot_alloc(struct jit_code *c) {
+  int slot = c->slots++;
+  if (c->slots > c->max_slots) {
+    c->max_slots = c->slots;
+  }
+  return slot;
+}
+
+// movsd xmm, [rbx + off]
+static void code_load_ctx(struct jit_code *c, int xmm, size_t off) {
+  CODE(c, 0xF2, 0x0F, 0x10, 0x83 | xmm << 3);
+  code_u32(c, off);
+}
+
+// movsd [rbx + off], xmm
+static void code_store_ctx(struct jit_code *c, int xmm, size_t off) {
+  CODE(c, 0xF2, 0x0F, 0x11, 0x83 | xmm << 3);
+  code_u32(c, off);
+}
+
+// movsd xmm, [rbp + slot]
+static void code_load_slot(struct jit_code *c, int xmm, int slot) {
+  CODE(c, 0xF2, 0x0F, 0x10, 0x85 | xmm << 3);
+  code_u32(c, code_slot_disp(slot));
+}
+
+// movsd [rbp + slot], xmm
+static void code_store_slot(struct jit_code *c, int xmm, int slot) {
+  CODE(c, 0xF2, 0x0F, 0x11, 0x85 | xmm << 3);
+  code_u32(c, code_slot_disp(slot));
+}
+
+// mov rax, imm64
+static void code_rax(struct jit_code *c, uint64_t v) {
+  CODE(c, 0x48, 0xB8);
+  code_u64(c, v);
+}
+
+// mov rax, imm64; movq xmm, rax
+static void code_load_imm(struct jit_code *c, int xmm, double v) {
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  code_rax(c, bits);
+  CODE(c, 0x66, 0x48, 0x0F, 0x6E, 0xC0 | xmm << 3);
+}
+
+// mov rax, imm64; movsd xmm, [rax]
+static void code_load_ptr(struct jit_code *c, int xmm, const double *p) {
+  code_rax(c, (uintptr_t)p);
+  CODE(c, 0xF2, 0x0F, 0x10, xmm << 3);
+}
+
+// mov rax, imm64; movsd [rax], xmm
+static void code_store_ptr(struct jit_code *c, int xmm, double *p) {
+  code_rax(c, (uintptr_t)p);
+  CODE(c, 0xF2, 0x0F, 0x11, xmm << 3);
+}
+
+// addsd, subsd, mulsd, divsd dst, src
+static void code_arith(struct jit_code *c, uint8_t op, int dst, int src) {
+  CODE(c, 0xF2, 0x0F, op, 0xC0 | dst << 3 | src);
+}
+
+// movapd dst, src
+static void code_move(struct jit_code *c, int dst, int src) {
+  CODE(c, 0x66, 0x0F, 0x28, 0xC0 | dst << 3 | src);
+}
+
+// mov rdi, rbx; mov rax, imm64; call rax
+static void code_call_ctx(struct jit_code *c, uint64_t fn) {
+  CODE(c, 0x48, 0x89, 0xDF);
+  code_rax(c, fn);
+  CODE(c, 0xFF, 0xD0);
+}
+
+// mov rdi, imm64; mov rsi, rbx; mov rax, imm64; call rax
+static void code_call_node(struct jit_code *c, uint64_t fn,
+                           const struct ast_node *node) {
+  CODE(c, 0x48, 0xBF);
+  code_u64(c, (uintptr_t)node);
+  CODE(c, 0x48, 0x89, 0xDE);
+  code_rax(c, fn);
+  CODE(c, 0xFF, 0xD0);
+}
+
+// jmp to the error exit
+static void code_jump_error(struct jit_code *c, uint8_t op0, uint8_t op1) {
+  if (op1) {
+    CODE(c, op0, op1);
+  } else {
+    CODE(c, op0);
+  }
+  if (c->error_count == c->error_capacity) {
+    c->error_capacity = c->error_capacity ? 2 * c->error_capacity : 16;
+    c->error_jumps =
+        realloc(c->error_jumps, c->error_capacity * sizeof(size_t));
+  }
+  c->error_jumps[c->error_count++] = c->len;
+  code_u32(c, 0);
+}
+
+// cmp byte [rbx + error], 0; jne error
+static void code_check_error(struct jit_code *c) {
+  CODE(c, 0x80, 0xBB);
+  code_u32(c, offsetof(struct context, error));
+  CODE(c, 0x00);
+  code_jump_error(c, 0x0F, 0x85);
+}
+
+static void jit_divide_by_zero(struct context *ctx) {
+  fprintf(ctx->log, "You can't divide by 0");
+  ctx->error = true;
+}
+
+/*
+ * compilation
+ */
+
+static void compile_expr(struct jit_code *c, const struct ast_node *e);
+static void compile_cmd(struct jit_code *c, const struct ast_node *s);
+
+// let the interpreter evaluate the expression
+static void compile_expr_fallback(struct jit_code *c,
+                                  const struct ast_node *e) {
+  code_call_node(c, (uintptr_t)&ast_node_eval_one, e);
+  code_check_error(c);
+}
+
+static void compile_binop(struct jit_code *c, const struct ast_node *e) {
+  int slot = code_slot_alloc(c);
+  compile_expr(c, e->children[0]);
+  code_store_slot(c, 0, slot);
+  compile_expr(c, e->children[1]);
+  code_move(c, 1, 0);
+  code_load_slot(c, 0, slot);
+  c->slots--;
+
+  switch (e->u.op) {
+  case '+':
+    code_arith(c, 0x58, 0, 1);
+    break;
+  case '-':
+    code_arith(c, 0x5C, 0, 1);
+    break;
+  case '*':
+    code_arith(c, 0x59, 0, 1);
+    break;
+  case '/': {
+    // xorpd xmm2, xmm2; ucomisd xmm1, xmm2; jp ok; jne ok
+    CODE(c, 0x66, 0x0F, 0x57, 0xD2, 0x66, 0x0F, 0x2E, 0xCA, 0x7A, 0x00);
+    size_t jp = c->len - 1;
+    CODE(c, 0x75, 0x00);
+    size_t jne = c->len - 1;
+    code_call_ctx(c, (uintptr_t)&jit_divide_by_zero);
+    code_jump_error(c, 0xE9, 0);
+    c->buf[jp] = c->len - (jp + 1);
+    c->buf[jne] = c->len - (jne + 1);
+    code_arith(c, 0x5E, 0, 1);
+    break;
+  }
+  case '^':
+    code_rax(c, (uintptr_t)&pow);
+    CODE(c, 0xFF, 0xD0);
+    break;
+  }
+}
+
+static void compile_expr(struct jit_code *c, const struct ast_node *e) {
+  switch (e->kind) {
+  case KIND_EXPR_VALUE:
+    code_load_imm(c, 0, e->u.value);
+    break;
+
+  case KIND_EXPR_NAME: {
+    union hashmap_val_union *val = hashmap_get(&c->ctx->variables, e->u.name);
+    if (!val) {
+      compile_expr_fallback(c, e);
+      break;
+    }
+    // buckets never move, the value is read in place
+    code_load_ptr(c, 0, &val->d);
+    break;
+  }
+
+  case KIND_EXPR_UNOP:
+    compile_expr(c, e->children[0]);
+    // flip the sign bit, like the C negation
+    code_rax(c, 0x8000000000000000ULL);
+    CODE(c, 0x66, 0x48, 0x0F, 0x6E, 0xC8, 0x66, 0x0F, 0x57, 0xC1);
+    break;
+
+  case KIND_EXPR_BINOP:
+    compile_binop(c, e);
+    break;
+
+  case KIND_EXPR_BLOCK:
+  case KIND_EXPR_INVARIANT:
+  case KIND_EXPR_INDUCTION:
+    // native code recomputes faster than it reads a cache
+    compile_expr(c, e->children[0]);
+    break;
+
+  case KIND_EXPR_FUNC:
+    if (e->u.func == FUNC_SIN || e->u.func == FUNC_COS) {
+      compile_expr(c, e->children[0]);
+      code_rax(c, e->u.func == FUNC_SIN ? (uintptr_t)&sin : (uintptr_t)&cos);
+      CODE(c, 0xFF, 0xD0);
+    } else {
+      compile_expr_fallback(c, e);
+    }
+    break;
+
+  default:
+    compile_expr_fallback(c, e);
+    break;
+  }
+}
+
+// let the interpreter evaluate the command
+static void compile_cmd_fallback(struct jit_code *c, const struct ast_node *s) {
+  code_call_node(c, (uintptr_t)&ast_node_eval_one, s);
+  code_check_error(c);
+}
+
+// run the loop body the number of times stored in the slot
+static void compile_loop(struct jit_code *c, int slot,
+                         const struct ast_node *body) {
+  // cmp qword [rbp + slot], 0; jle end
+  size_t top = c->len;
+  CODE(c, 0x48, 0x83, 0xBD);
+  code_u32(c, code_slot_disp(slot));
+  CODE(c, 0x00, 0x0F, 0x8E);
+  size_t end = c->len;
+  code_u32(c, 0);
+
+  for (const struct ast_node *n = body; n; n = n->next) {
+    compile_cmd(c, n);
+  }
+
+  // dec qword [rbp + slot]; jmp top
+  CODE(c, 0x48, 0xFF, 0x8D);
+  code_u32(c, code_slot_disp(slot));
+  CODE(c, 0xE9);
+  code_u32(c, (uint32_t)(top - (c->len + 4)));
+  code_bind(c, end);
+}
+
+static void compile_simple(struct jit_code *c, const struct ast_node *s) {
+  switch (s->u.cmd) {
+  case CMD_UP:
+  case CMD_DOWN:
+    // mov byte [rbx + up], imm8
+    CODE(c, 0xC6, 0x83);
+    code_u32(c, offsetof(struct context, up));
+    CODE(c, s->u.cmd == CMD_UP);
+    break;
+
+  case CMD_LEFT:
+  case CMD_RIGHT:
+    compile_expr(c, s->children[0]);
+    code_move(c, 1, 0);
+    code_load_ctx(c, 0, offsetof(struct context, angle));
+    code_arith(c, s->u.cmd == CMD_LEFT ? 0x58 : 0x5C, 0, 1);
+    code_store_ctx(c, 0, offsetof(struct context, angle));
+    break;
+
+  case CMD_HEADING:
+    compile_expr(c, s->children[0]);
+    code_store_ctx(c, 0, offsetof(struct context, angle));
+    break;
+
+  case CMD_FORWARD:
+  case CMD_BACKWARD:
+    compile_expr(c, s->children[0]);
+    code_call_ctx(c, s->u.cmd == CMD_FORWARD ? (uintptr_t)&context_forward
+                                             : (uintptr_t)&context_backward);
+    code_check_error(c);
+    break;
+
+  case CMD_HOME:
+    code_call_ctx(c, (uintptr_t)&context_home);
+    code_check_error(c);
+    break;
+
+  case CMD_POSITION: {
+    int slot = code_slot_alloc(c);
+    compile_expr(c, s->children[0]);
+    code_store_slot(c, 0, slot);
+    compile_expr(c, s->children[1]);
+    code_move(c, 1, 0);
+    code_load_slot(c, 0, slot);
+    c->slots--;
+    code_call_ctx(c, (uintptr_t)&context_position);
+    code_check_error(c);
+    break;
+  }
+
+  case CMD_COLOR: {
+    int r = code_slot_alloc(c);
+    int g = code_slot_alloc(c);
+    compile_expr(c, s->children[0]);
+    code_store_slot(c, 0, r);
+    compile_expr(c, s->children[1]);
+    code_store_slot(c, 0, g);
+    compile_expr(c, s->children[2]);
+    code_move(c, 2, 0);
+    code_load_slot(c, 0, r);
+    code_load_slot(c, 1, g);
+    c->slots -= 2;
+    code_call_ctx(c, (uintptr_t)&context_color);
+    code_check_error(c);
+    break;
+  }
+
+  default:
+    // print writes its value even after an error
+    compile_cmd_fallback(c, s);
+    break;
+  }
+}
+
+static void compile_cmd(struct jit_code *c, const struct ast_node *s) {
+  switch (s->kind) {
+  case KIND_CMD_SIMPLE:
+    compile_simple(c, s);
+    break;
+
+  case KIND_CMD_BLOCK:
+    for (const struct ast_node *n = s->children[0]; n; n = n->next) {
+      compile_cmd(c, n);
+    }
+    break;
+
+  case KIND_CMD_REPEAT: {
+    compile_expr(c, s->children[0]);
+    code_call_ctx(c, (uintptr_t)&context_repeat_count);
+    code_check_error(c);
+    int slot = code_slot_alloc(c);
+    // movsxd rax, eax; mov [rbp + slot], rax
+    CODE(c, 0x48, 0x63, 0xC0, 0x48, 0x89, 0x85);
+    code_u32(c, code_slot_disp(slot));
+    if (s->u.caches.count > 0) {
+      // the interpreted parts of the body may read the caches
+      // mov rsi, imm64; mov rdx, imm64
+      CODE(c, 0x48, 0xBE);
+      code_u64(c, s->u.caches.first);
+      CODE(c, 0x48, 0xBA);
+      code_u64(c, s->u.caches.count);
+      code_call_ctx(c, (uintptr_t)&context_cache_reset);
+    }
+    compile_loop(c, slot, s->children[1]);
+    c->slots--;
+    break;
+  }
+
+  case KIND_CMD_SET: {
+    union hashmap_val_union *val = hashmap_get(&c->ctx->variables, s->u.name);
+    if (!val) {
+      compile_cmd_fallback(c, s);
+      break;
+    }
+    compile_expr(c, s->children[0]);
+    code_store_ptr(c, 0, &val->d);
+    break;
+  }
+
+  default:
+    compile_cmd_fallback(c, s);
+    break;
+  }
+}
+
+static jit_fn jit_compile(struct jit *self, const struct ast_node *body,
+                          struct context *ctx) {
+  struct jit_code c;
+  memset(&c, 0, sizeof(c));
+  c.ctx = ctx;
+
+  // push rbp; mov rbp, rsp; push rbx; push r12; sub rsp, frame; mov rbx, rdi
+  CODE(&c, 0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54, 0x48, 0x81, 0xEC);
+  size_t frame = c.len;
+  code_u32(&c, 0);
+  CODE(&c, 0x48, 0x89, 0xFB);
+
+  // mov [rbp + slot], rsi
+  int slot = code_slot_alloc(&c);
+  CODE(&c, 0x48, 0x89, 0xB5);
+  code_u32(&c, code_slot_disp(slot));
+  compile_loop(&c, slot, body);
+
+  // xor eax, eax; then the epilogue
+  CODE(&c, 0x31, 0xC0);
+  size_t epilogue = c.len;
+  // lea rsp, [rbp - 16]; pop r12; pop rbx; pop rbp; ret
+  CODE(&c, 0x48, 0x8D, 0x65, 0xF0, 0x41, 0x5C, 0x5B, 0x5D, 0xC3);
+  // mov eax, 1; jmp epilogue
+  size_t error = c.len;
+  CODE(&c, 0xB8, 0x01, 0x00, 0x00, 0x00, 0xE9);
+  code_u32(&c, (uint32_t)(epilogue - (c.len + 4)));
+
+  for (size_t i = 0; i < c.error_count; ++i) {
+    size_t field = c.error_jumps[i];
+    code_patch32(&c, field, (uint32_t)(error - (field + 4)));
+  }
+  code_patch32(&c, frame, (uint32_t)((c.max_slots * 8 + 15) & ~15));
+
+  jit_fn fn = NULL;
+  void *addr = mmap(NULL, c.len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (addr != MAP_FAILED) {
+    memcpy(addr, c.buf, c.len);
+    if (mprotect(addr, c.len, PROT_READ | PROT_EXEC) == 0) {
+      if (self->regions_count == self->regions_capacity) {
+        self->regions_capacity =
+            self->regions_capacity ? 2 * self->regions_capacity : 8;
+        self->regions = realloc(self->regions, self->regions_capacity *
+                                                   sizeof(struct jit_region));
+      }
+      self->regions[self->regions_count].addr = addr;
+      self->regions[self->regions_count].len = c.len;
+      self->regions_count++;
+      memcpy(&fn, &addr, sizeof(fn));
+    } else {
+      munmap(addr, c.len);
+    }
+  }
+
+  free(c.buf);
+  free(c.error_jumps);
+  return fn;
+}
+
+#else
+
+static jit_fn jit_compile(struct jit *self, const struct ast_node *body,
+                          struct context *ctx) {
+  (void)self;
+  (void)body;
+  (void)ctx;
+  return NULL;
+}
+
+#endif // JIT_SUPPORTED
+
+bool jit_repeat(struct jit *self, const struct ast_node *node,
+                struct context *ctx, int remaining) {
+  // instrumented runs count every node visit
+  if (ctx->metrics) {
+    return false;
+  }
+  struct jit_entry *entry = jit_entry(self, node);
+  if (!entry->fn) {
+    if (entry->failed || ++entry->runs <= JIT_THRESHOLD) {
+      return false;
+    }
+    entry->fn = jit_compile(self, node->children[1], ctx);
+    if (!entry->fn) {
+      entry->failed = true;
+      return false;
+    }
+  }
+  // the entry may move while the body runs
+  jit_fn fn = entry->fn;
+  fn(ctx, remaining);
+  return true;
+}
@@ -0,0 +1,30 @@
+#ifndef TURTLE_JIT_H
+#define TURTLE_JIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct ast_node;
+struct context;
+
+// number of iterations of a repeat body before it is compiled
+#define JIT_THRESHOLD 64
+
+// native code compiled for the repeat bodies evaluated in one context
+struct jit;
+
+// NULL when native code is not supported on this machine
+struct jit *jit_create(void);
+void jit_destroy(struct jit *self);
+
+// called by the interpreter before each iteration of a repeat node, runs
+// the remaining iterations natively once the body is hot and returns true
+// in this case, false if the interpreter has to run the iteration
+bool jit_repeat(struct jit *self, const struct ast_node *node,
+                struct context *ctx, int remaining);
+
+// drop the compiled code and the counters, before the nodes they were made
+// from are freed
+void jit_forget(struct jit *self);
+
+#endif /* TURTLE_JIT_H */
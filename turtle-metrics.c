@@ -0,0 +1,181 @@
+#include "turtle-metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static const char *const metrics_phase_names[METRICS_PHASES] = {
+    "parse",
+    "optimize",
+    "eval",
+    "output",
+};
+
+static const char *const metrics_kind_names[METRICS_KINDS] = {
+    "cmd_simple", "cmd_repeat", "cmd_block", "cmd_proc",
+    "cmd_call",   "cmd_set",    "expr_func", "expr_value",
+    "expr_unop",  "expr_binop", "expr_block", "expr_name",
+    "expr_invariant", "expr_induction",
+};
+
+double metrics_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+bool metrics_create(struct metrics *self, const char *trace_path) {
+  memset(self, 0, sizeof(struct metrics));
+  self->origin = metrics_now();
+  if (trace_path) {
+    self->trace = fopen(trace_path, "w");
+    if (!self->trace) {
+      perror(trace_path);
+      return false;
+    }
+    fputs("{\"traceEvents\":[", self->trace);
+    self->trace_empty = true;
+  }
+  return true;
+}
+
+void metrics_destroy(struct metrics *self) {
+  if (self->trace) {
+    fputs("\n]}\n", self->trace);
+    fclose(self->trace);
+    self->trace = NULL;
+  }
+}
+
+void metrics_phase_begin(struct metrics *self, enum metrics_phase phase) {
+  self->phase_start[phase] = metrics_now();
+}
+
+void metrics_phase_end(struct metrics *self, enum metrics_phase phase) {
+  double end = metrics_now();
+  self->phase_time[phase] += end - self->phase_start[phase];
+  metrics_trace(self, "phase", metrics_phase_names[phase],
+                self->phase_start[phase], end);
+}
+
+void metrics_attach(struct metrics *self, struct context *ctx) {
+  ctx->metrics = self;
+  ctx->variables.stats = &self->variables;
+  ctx->procedures.stats = &self->procedures;
+}
+
+void metrics_trace(struct metrics *self, const char *category,
+                   const char *name, double start, double end) {
+  if (!self->trace) {
+    return;
+  }
+  fprintf(self->trace,
+          "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+          "\"dur\":%.3f,\"pid\":1,\"tid\":1}",
+          self->trace_empty ? "" : ",", name, category,
+          (start - self->origin) * 1e6, (end - start) * 1e6);
+  self->trace_empty = false;
+}
+
+static long metrics_peak_rss_kb(void) {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return 0;
+  }
+  return usage.ru_maxrss;
+}
+
+static double metrics_mean_probes(const struct hashmap_stats *stats) {
+  return stats->lookups ? (double)stats->probes / stats->lookups : 0;
+}
+
+static void metrics_write_json(const struct metrics *self,
+                               const struct output *out, FILE *file) {
+  fprintf(file, "{\n  \"phases\": {");
+  for (size_t i = 0; i < METRICS_PHASES; ++i) {
+    fprintf(file, "%s\"%s\": %.9f", i ? ", " : "", metrics_phase_names[i],
+            self->phase_time[i]);
+  }
+  fprintf(file, "},\n  \"visits\": {");
+  for (size_t i = 0; i < METRICS_KINDS; ++i) {
+    fprintf(file, "%s\"%s\": %zu", i ? ", " : "", metrics_kind_names[i],
+            self->visits[i]);
+  }
+  fprintf(file, "},\n");
+
+  const struct hashmap_stats *maps[] = {&self->variables, &self->procedures};
+  const char *map_names[] = {"variables", "procedures"};
+  for (size_t i = 0; i < 2; ++i) {
+    fprintf(file,
+            "  \"%s\": {\"lookups\": %zu, \"misses\": %zu, \"mean_probes\": "
+            "%.3f, \"max_probes\": %zu},\n",
+            map_names[i], maps[i]->lookups, maps[i]->misses,
+            metrics_mean_probes(maps[i]), maps[i]->max_probes);
+  }
+
+  fprintf(file,
+          "  \"records\": %zu,\n  \"bytes\": %zu,\n  \"peak_rss_kb\": %ld,\n"
+          "  \"max_depth\": %zu,\n  \"max_call_depth\": %zu\n}\n",
+          self->records, output_bytes(out), metrics_peak_rss_kb(),
+          self->max_depth, self->max_call_depth);
+}
+
+static void metrics_write_openmetrics(const struct metrics *self,
+                                      const struct output *out, FILE *file) {
+  fprintf(file, "# TYPE turtle_phase_seconds gauge\n");
+  for (size_t i = 0; i < METRICS_PHASES; ++i) {
+    fprintf(file, "turtle_phase_seconds{phase=\"%s\"} %.9f\n",
+            metrics_phase_names[i], self->phase_time[i]);
+  }
+  fprintf(file, "# TYPE turtle_node_visits counter\n");
+  for (size_t i = 0; i < METRICS_KINDS; ++i) {
+    fprintf(file, "turtle_node_visits_total{kind=\"%s\"} %zu\n",
+            metrics_kind_names[i], self->visits[i]);
+  }
+
+  const struct hashmap_stats *maps[] = {&self->variables, &self->procedures};
+  const char *map_names[] = {"variables", "procedures"};
+  fprintf(file, "# TYPE turtle_map_lookups counter\n");
+  for (size_t i = 0; i < 2; ++i) {
+    fprintf(file, "turtle_map_lookups_total{map=\"%s\"} %zu\n", map_names[i],
+            maps[i]->lookups);
+  }
+  fprintf(file, "# TYPE turtle_map_misses counter\n");
+  for (size_t i = 0; i < 2; ++i) {
+    fprintf(file, "turtle_map_misses_total{map=\"%s\"} %zu\n", map_names[i],
+            maps[i]->misses);
+  }
+  fprintf(file, "# TYPE turtle_map_probes counter\n");
+  for (size_t i = 0; i < 2; ++i) {
+    fprintf(file, "turtle_map_probes_total{map=\"%s\"} %zu\n", map_names[i],
+            maps[i]->probes);
+  }
+  fprintf(file, "# TYPE turtle_map_max_probes gauge\n");
+  for (size_t i = 0; i < 2; ++i) {
+    fprintf(file, "turtle_map_max_probes{map=\"%s\"} %zu\n", map_names[i],
+            maps[i]->max_probes);
+  }
+
+  fprintf(file,
+          "# TYPE turtle_records counter\nturtle_records_total %zu\n"
+          "# TYPE turtle_output_bytes counter\nturtle_output_bytes_total %zu\n"
+          "# TYPE turtle_peak_rss_bytes gauge\nturtle_peak_rss_bytes %ld\n"
+          "# TYPE turtle_max_depth gauge\nturtle_max_depth %zu\n"
+          "# TYPE turtle_max_call_depth gauge\nturtle_max_call_depth %zu\n"
+          "# EOF\n",
+          self->records, output_bytes(out), metrics_peak_rss_kb() * 1024,
+          self->max_depth, self->max_call_depth);
+}
+
+void metrics_write(const struct metrics *self, const struct output *out,
+                   enum metrics_format format, FILE *file) {
+  switch (format) {
+  case METRICS_JSON:
+    metrics_write_json(self, out, file);
+    break;
+  case METRICS_OPENMETRICS:
+    metrics_write_openmetrics(self, out, file);
+    break;
+  }
+}
@@ -0,0 +1,69 @@
+#ifndef TURTLE_METRICS_H
+#define TURTLE_METRICS_H
+
+#include "hasmap.h"
+#include "turtle-ast.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// phases of a run of the interpreter
+enum metrics_phase {
+  PHASE_PARSE,
+  PHASE_OPTIMIZE,
+  PHASE_EVAL,
+  PHASE_OUTPUT,
+};
+
+#define METRICS_PHASES (PHASE_OUTPUT + 1)
+#define METRICS_KINDS (KIND_EXPR_INDUCTION + 1)
+
+// what the interpreter measures when instrumentation is enabled
+struct metrics {
+  double origin; // start of the run, in seconds
+  double phase_start[METRICS_PHASES];
+  double phase_time[METRICS_PHASES];
+
+  size_t visits[METRICS_KINDS]; // ast_node_eval calls by kind
+  size_t depth;                 // current ast_node_eval recursion depth
+  size_t max_depth;
+  size_t call_depth; // current number of nested procedure calls
+  size_t max_call_depth;
+  size_t records; // records pushed to the output
+
+  struct hashmap_stats variables;
+  struct hashmap_stats procedures;
+
+  FILE *trace; // Chrome trace events, NULL if disabled
+  bool trace_empty;
+};
+
+enum metrics_format {
+  METRICS_JSON,
+  METRICS_OPENMETRICS,
+};
+
+// start measuring, trace_path may be NULL, false if it can not be opened
+bool metrics_create(struct metrics *self, const char *trace_path);
+// close the trace
+void metrics_destroy(struct metrics *self);
+
+// monotonic time in seconds
+double metrics_now(void);
+
+void metrics_phase_begin(struct metrics *self, enum metrics_phase phase);
+void metrics_phase_end(struct metrics *self, enum metrics_phase phase);
+
+// count lookups in the maps of the context
+void metrics_attach(struct metrics *self, struct context *ctx);
+
+// add a complete event to the trace, times from metrics_now
+void metrics_trace(struct metrics *self, const char *category,
+                   const char *name, double start, double end);
+
+// write the counters, along with the bytes written by the output chain
+void metrics_write(const struct metrics *self, const struct output *out,
+                   enum metrics_format format, FILE *file);
+
+#endif /* TURTLE_METRICS_H */
@@ -0,0 +1,375 @@
+#include "hasmap.h"
+#include "turtle-ast.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+// bound on the coefficients and the offsets of the induction expressions,
+// with AST_INDUCTION_LIMIT every intermediate result is an integer below 2^53
+#define OPTIMIZE_AFFINE_LIMIT 1048576.0
+
+struct optimizer {
+  size_t slots; // caches handed out so far
+};
+
+/*
+ * constant folding
+ */
+
+// turn the node into a literal
+static void fold_value(struct ast_node *node, double value) {
+  for (size_t i = 0; i < node->children_count; ++i) {
+    ast_node_destroy(node->children[i]);
+    free(node->children[i]);
+    node->children[i] = NULL;
+  }
+  node->children_count = 0;
+  node->kind = KIND_EXPR_VALUE;
+  node->u.value = value;
+}
+
+static bool is_value(const struct ast_node *node) {
+  return node->kind == KIND_EXPR_VALUE;
+}
+
+// compute the constant expressions the same way as the evaluation, the
+// ones that would fail are kept for the error to happen at run time
+static void fold(struct ast_node *node) {
+  for (size_t i = 0; i < node->children_count; ++i) {
+    for (struct ast_node *n = node->children[i]; n; n = n->next) {
+      fold(n);
+    }
+  }
+
+  switch (node->kind) {
+  case KIND_EXPR_UNOP:
+    if (is_value(node->children[0])) {
+      fold_value(node, -node->children[0]->u.value);
+    }
+    break;
+
+  case KIND_EXPR_BLOCK:
+    if (is_value(node->children[0])) {
+      fold_value(node, node->children[0]->u.value);
+    }
+    break;
+
+  case KIND_EXPR_BINOP: {
+    if (!is_value(node->children[0]) || !is_value(node->children[1])) {
+      break;
+    }
+    double rhs = node->children[0]->u.value;
+    double lhs = node->children[1]->u.value;
+    switch (node->u.op) {
+    case '+':
+      fold_value(node, rhs + lhs);
+      break;
+    case '-':
+      fold_value(node, rhs - lhs);
+      break;
+    case '/':
+      if (lhs != 0) {
+        fold_value(node, rhs / lhs);
+      }
+      break;
+    case '*':
+      fold_value(node, rhs * lhs);
+      break;
+    case '^':
+      fold_value(node, pow(rhs, lhs));
+      break;
+    }
+    break;
+  }
+
+  case KIND_EXPR_FUNC: {
+    if (node->u.func == FUNC_RANDOM || !is_value(node->children[0])) {
+      break;
+    }
+    double x = node->children[0]->u.value;
+    switch (node->u.func) {
+    case FUNC_SIN:
+      fold_value(node, sin(x));
+      break;
+    case FUNC_COS:
+      fold_value(node, cos(x));
+      break;
+    case FUNC_TAN:
+      if (!isnan(tan(x))) {
+        fold_value(node, tan(x));
+      }
+      break;
+    case FUNC_SQRT:
+      if (!(x < 0)) {
+        fold_value(node, sqrt(x));
+      }
+      break;
+    case FUNC_RANDOM:
+      break;
+    }
+    break;
+  }
+
+  default:
+    break;
+  }
+}
+
+/*
+ * analysis of the repeat bodies
+ */
+
+// whether node computes coef * name + offset from integer literals, then
+// each step of its evaluation is exact while name is an integer below
+// AST_INDUCTION_LIMIT
+static bool affine(const struct ast_node *node, const char *name,
+                   double *coef, double *offset) {
+  double c0, o0, c1, o1;
+  switch (node->kind) {
+  case KIND_EXPR_VALUE:
+    *coef = 0;
+    *offset = node->u.value;
+    break;
+
+  case KIND_EXPR_NAME:
+    if (strcmp(node->u.name, name) != 0) {
+      return false;
+    }
+    *coef = 1;
+    *offset = 0;
+    break;
+
+  case KIND_EXPR_BLOCK:
+    return affine(node->children[0], name, coef, offset);
+
+  case KIND_EXPR_UNOP:
+    if (!affine(node->children[0], name, &c0, &o0)) {
+      return false;
+    }
+    *coef = -c0;
+    *offset = -o0;
+    break;
+
+  case KIND_EXPR_BINOP:
+    if (!affine(node->children[0], name, &c0, &o0) ||
+        !affine(node->children[1], name, &c1, &o1)) {
+      return false;
+    }
+    switch (node->u.op) {
+    case '+':
+      *coef = c0 + c1;
+      *offset = o0 + o1;
+      break;
+    case '-':
+      *coef = c0 - c1;
+      *offset = o0 - o1;
+      break;
+    case '*':
+      if (c0 != 0 && c1 != 0) {
+        return false;
+      }
+      *coef = c0 * o1 + c1 * o0;
+      *offset = o0 * o1;
+      break;
+    default:
+      return false;
+    }
+    break;
+
+  default:
+    return false;
+  }
+  return *coef == trunc(*coef) && *offset == trunc(*offset) &&
+         fabs(*coef) <= OPTIMIZE_AFFINE_LIMIT &&
+         fabs(*offset) <= OPTIMIZE_AFFINE_LIMIT;
+}
+
+// what a repeat body does to the variables, names belong to the tree
+struct loop_effects {
+  struct hashmap writes; // variables set
+  struct hashmap steps;  // variables set, 1 if only ever stepped by a constant
+  bool calls;            // a procedure may set anything
+};
+
+static void loop_collect(struct loop_effects *self,
+                         const struct ast_node *node) {
+  switch (node->kind) {
+  case KIND_CMD_SET: {
+    union hashmap_val_union val;
+    val.d = 0;
+    hashmap_set(&self->writes, node->u.name, val);
+
+    double coef, offset;
+    union hashmap_val_union *step = hashmap_get(&self->steps, node->u.name);
+    if (affine(node->children[0], node->u.name, &coef, &offset) &&
+        coef == 1 && offset != 0 && (!step || step->d == 1)) {
+      val.d = 1;
+    }
+    hashmap_set(&self->steps, node->u.name, val);
+    break;
+  }
+  case KIND_CMD_CALL:
+    self->calls = true;
+    break;
+  case KIND_CMD_PROC:
+    return;
+  default:
+    break;
+  }
+  for (size_t i = 0; i < node->children_count; ++i) {
+    for (const struct ast_node *n = node->children[i]; n; n = n->next) {
+      loop_collect(self, n);
+    }
+  }
+}
+
+// whether the value of node can not change while the body runs
+static bool invariant(const struct ast_node *node,
+                      const struct hashmap *writes) {
+  if (node->kind == KIND_EXPR_NAME) {
+    return hashmap_get(writes, node->u.name) == NULL;
+  }
+  if (node->kind == KIND_EXPR_FUNC && node->u.func == FUNC_RANDOM) {
+    return false;
+  }
+  for (size_t i = 0; i < node->children_count; ++i) {
+    if (!invariant(node->children[i], writes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * rewriting
+ */
+
+// move the expression below a new node of the given kind, in place so
+// that the parent is unchanged
+static void wrap(struct ast_node *node, enum ast_kind kind, size_t slot) {
+  struct ast_node *inner = malloc(sizeof(struct ast_node));
+  *inner = *node;
+  inner->next = NULL;
+  memset(node->children, 0, sizeof(node->children));
+  node->kind = kind;
+  node->children_count = 1;
+  node->children[0] = inner;
+  node->u.cache.slot = slot;
+  node->u.cache.coef = 0;
+}
+
+typedef void (*optimize_visit)(struct optimizer *self, struct ast_node *expr,
+                               const struct loop_effects *effects);
+
+// visit the expressions of the commands, the definitions of procedures are
+// not part of the loop
+static void visit_exprs(struct optimizer *self, struct ast_node *cmd,
+                        const struct loop_effects *effects,
+                        optimize_visit visit) {
+  for (; cmd; cmd = cmd->next) {
+    switch (cmd->kind) {
+    case KIND_CMD_PROC:
+      break;
+    case KIND_CMD_BLOCK:
+      visit_exprs(self, cmd->children[0], effects, visit);
+      break;
+    case KIND_CMD_REPEAT:
+      visit(self, cmd->children[0], effects);
+      visit_exprs(self, cmd->children[1], effects, visit);
+      break;
+    default:
+      for (size_t i = 0; i < cmd->children_count; ++i) {
+        visit(self, cmd->children[i], effects);
+      }
+      break;
+    }
+  }
+}
+
+// cache the largest invariant expressions
+static void hoist(struct optimizer *self, struct ast_node *expr,
+                  const struct loop_effects *effects) {
+  if (expr->kind == KIND_EXPR_VALUE || expr->kind == KIND_EXPR_INVARIANT) {
+    return;
+  }
+  if (invariant(expr, &effects->writes)) {
+    wrap(expr, KIND_EXPR_INVARIANT, self->slots++);
+    return;
+  }
+  for (size_t i = 0; i < expr->children_count; ++i) {
+    hoist(self, expr->children[i], effects);
+  }
+}
+
+// update incrementally the largest affine expressions of a stepped variable
+static void reduce(struct optimizer *self, struct ast_node *expr,
+                   const struct loop_effects *effects) {
+  if (expr->kind == KIND_EXPR_VALUE || expr->kind == KIND_EXPR_NAME ||
+      expr->kind == KIND_EXPR_INVARIANT || expr->kind == KIND_EXPR_INDUCTION) {
+    return;
+  }
+  const struct hashmap *steps = &effects->steps;
+  for (size_t i = 0; i < steps->size; ++i) {
+    for (struct hashmap_bucket *b = steps->bucket_array[i]; b; b = b->next) {
+      double coef, offset;
+      if (b->data.d == 1 && affine(expr, b->key, &coef, &offset) &&
+          coef != 0) {
+        wrap(expr, KIND_EXPR_INDUCTION, self->slots++);
+        expr->u.cache.coef = coef;
+        expr->children_count = 2;
+        expr->children[1] = make_expr_name(strdup(b->key));
+        return;
+      }
+    }
+  }
+  for (size_t i = 0; i < expr->children_count; ++i) {
+    reduce(self, expr->children[i], effects);
+  }
+}
+
+static void optimize_loop(struct optimizer *self, struct ast_node *loop) {
+  struct loop_effects effects;
+  hashmap_create(&effects.writes);
+  hashmap_create(&effects.steps);
+  effects.calls = false;
+  loop_collect(&effects, loop->children[1]);
+
+  if (!effects.calls) {
+    loop->u.caches.first = self->slots;
+    visit_exprs(self, loop->children[1], &effects, hoist);
+    loop->u.caches.count = self->slots - loop->u.caches.first;
+    visit_exprs(self, loop->children[1], &effects, reduce);
+  }
+
+  hashmap_destroy(&effects.steps);
+  hashmap_destroy(&effects.writes);
+}
+
+// the outer loops first, so that an expression is cached in the outermost
+// loop where it is invariant
+static void optimize_node(struct optimizer *self, struct ast_node *node) {
+  if (node->kind == KIND_CMD_REPEAT) {
+    optimize_loop(self, node);
+  }
+  for (size_t i = 0; i < node->children_count; ++i) {
+    for (struct ast_node *n = node->children[i]; n; n = n->next) {
+      optimize_node(self, n);
+    }
+  }
+}
+
+void ast_optimize_node(struct ast *self, struct ast_node *node) {
+  fold(node);
+  struct optimizer optimizer;
+  optimizer.slots = self->slots;
+  optimize_node(&optimizer, node);
+  self->slots = optimizer.slots;
+}
+
+void ast_optimize(struct ast *self) {
+  for (struct ast_node *node = self->unit; node; node = node->next) {
+    ast_optimize_node(self, node);
+  }
+}
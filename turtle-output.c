@@ -0,0 +1,140 @@
+#include "turtle-output.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+void output_emit(struct output *self, const struct output_record *rec) {
+  self->emit(self, rec);
+}
+
+bool output_finish(struct output *self) {
+  bool ok = true;
+  while (self) {
+    if (self->finish && !self->finish(self)) {
+      ok = false;
+    }
+    self = self->next;
+  }
+  return ok;
+}
+
+void output_destroy(struct output *self) {
+  while (self) {
+    struct output *next = self->next;
+    self->destroy(self);
+    self = next;
+  }
+}
+
+size_t output_bytes(const struct output *self) {
+  size_t bytes = 0;
+  while (self) {
+    bytes += self->bytes;
+    self = self->next;
+  }
+  return bytes;
+}
+
+/*
+ * text
+ */
+
+struct output_text {
+  struct output base;
+  FILE *file;
+};
+
+static void output_text_emit(struct output *self,
+                             const struct output_record *rec) {
+  struct output_text *text = (struct output_text *)self;
+  int n = 0;
+  switch (rec->kind) {
+  case OUTPUT_MOVE_TO:
+    n = fprintf(text->file, "MoveTo %lf %lf\n", rec->u.point.x,
+                rec->u.point.y);
+    break;
+  case OUTPUT_LINE_TO:
+    n = fprintf(text->file, "LineTo %lf %lf\n", rec->u.point.x,
+                rec->u.point.y);
+    break;
+  case OUTPUT_COLOR:
+    n = fprintf(text->file, "Color %lf %lf %lf\n", rec->u.color.r,
+                rec->u.color.g, rec->u.color.b);
+    break;
+  }
+  if (n > 0) {
+    self->bytes += n;
+  }
+}
+
+static bool output_text_finish(struct output *self) {
+  struct output_text *text = (struct output_text *)self;
+  return fflush(text->file) == 0;
+}
+
+static void output_text_destroy(struct output *self) { free(self); }
+
+struct output *output_text_create(FILE *file) {
+  struct output_text *text = calloc(1, sizeof(struct output_text));
+  text->base.emit = output_text_emit;
+  text->base.finish = output_text_finish;
+  text->base.destroy = output_text_destroy;
+  text->base.next = NULL;
+  text->file = file;
+  return &text->base;
+}
+
+FILE *output_text_file(const struct output *self) {
+  if (!self || self->emit != output_text_emit) {
+    return NULL;
+  }
+  return ((const struct output_text *)self)->file;
+}
+
+/*
+ * buffer
+ */
+
+struct output_buffer {
+  struct output base;
+  struct output_record *records;
+  size_t count;
+  size_t capacity;
+};
+
+static void output_buffer_emit(struct output *self,
+                               const struct output_record *rec) {
+  struct output_buffer *buffer = (struct output_buffer *)self;
+  if (buffer->count == buffer->capacity) {
+    buffer->capacity = buffer->capacity ? 2 * buffer->capacity : 256;
+    buffer->records = realloc(buffer->records,
+                              buffer->capacity * sizeof(struct output_record));
+  }
+  buffer->records[buffer->count++] = *rec;
+}
+
+static void output_buffer_destroy(struct output *self) {
+  struct output_buffer *buffer = (struct output_buffer *)self;
+  free(buffer->records);
+  free(buffer);
+}
+
+struct output *output_buffer_create(void) {
+  struct output_buffer *buffer = calloc(1, sizeof(struct output_buffer));
+  buffer->base.emit = output_buffer_emit;
+  buffer->base.finish = NULL;
+  buffer->base.destroy = output_buffer_destroy;
+  buffer->base.next = NULL;
+  return &buffer->base;
+}
+
+void output_buffer_replay(struct output *self, struct output *out) {
+  struct output_buffer *buffer = (struct output_buffer *)self;
+  for (size_t i = 0; i < buffer->count; ++i) {
+    output_emit(out, &buffer->records[i]);
+  }
+  free(buffer->records);
+  buffer->records = NULL;
+  buffer->count = 0;
+  buffer->capacity = 0;
+}
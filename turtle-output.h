@@ -0,0 +1,208 @@
+#ifndef TURTLE_OUTPUT_H
+#define TURTLE_OUTPUT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// kind of a record in the emitted command stream
+enum output_kind {
+  OUTPUT_MOVE_TO,
+  OUTPUT_LINE_TO,
+  OUTPUT_COLOR,
+};
+
+// a record of the emitted command stream
+struct output_record {
+  enum output_kind kind;
+
+  union {
+    struct {
+      double x;
+      double y;
+    } point; // kind == OUTPUT_MOVE_TO or kind == OUTPUT_LINE_TO
+    struct {
+      double r;
+      double g;
+      double b;
+    } color; // kind == OUTPUT_COLOR
+  } u;
+};
+
+// a stage of the output pipeline
+//
+// the interpreter pushes every record into the first stage, filters forward
+// what they keep to the next stage and backends write it somewhere
+struct output {
+  void (*emit)(struct output *self, const struct output_record *rec);
+  bool (*finish)(struct output *self);  // flush pending records, may be NULL
+  void (*destroy)(struct output *self); // free the stage itself
+  struct output *next;                  // the next stage, NULL for backends
+  size_t bytes;                         // bytes written by a backend
+};
+
+void output_emit(struct output *self, const struct output_record *rec);
+// finish every stage of the chain, in order, false if one of them failed
+bool output_finish(struct output *self);
+// destroy every stage of the chain
+void output_destroy(struct output *self);
+// bytes written by the backends of the chain
+size_t output_bytes(const struct output *self);
+
+// backend that writes the text format read by turtle-viewer
+struct output *output_text_create(FILE *file);
+// the file of a text backend, NULL for any other stage
+FILE *output_text_file(const struct output *self);
+
+/*
+ * buffer: keep the records in memory to replay them later
+ */
+
+struct output *output_buffer_create(void);
+// push the buffered records into another chain and empty the buffer
+void output_buffer_replay(struct output *self, struct output *out);
+
+/*
+ * raster: render the drawing to an image without any window
+ */
+
+struct output_raster_options {
+  const char *path;  // written as PNG if it ends with .png, as PPM otherwise
+  unsigned width;    // in pixels
+  unsigned height;   // in pixels
+  double line_width; // in pixels
+  unsigned threads;  // 0 for one per online processor
+};
+
+struct output *output_raster_create(const struct output_raster_options *opts);
+
+/*
+ * svg: stream the drawing as a vector image
+ */
+
+struct output_svg_options {
+  const char *path;  // "-" for stdout
+  int precision;     // digits kept after the decimal point
+  double line_width; // in drawing units
+};
+
+// consecutive lines of the same color are batched into one path element
+// with relative coordinates, NULL if the file can not be opened
+struct output *output_svg_create(const struct output_svg_options *opts);
+
+/*
+ * archive: a compact replay file where any step can be reached by
+ * decompressing a single block
+ *
+ * file    = header block* index trailer, integers little-endian
+ * header  = "TRTLARC1" version:u32 block_records:u32
+ * block   = block_records records, the last one may be shorter, compressed
+ *           on its own (see turtle-archive.c), each record is a kind byte
+ *           then zig-zag varint deltas of the quantized point or color
+ *           from the previous one in the block, or from the state of the
+ *           turtle at the start of the block for the first one
+ * index   = per block: offset:u64 size:u32 raw_size:u32 first_record:u64
+ *           first_step:u64 x:i64 y:i64 r:i64 g:i64 b:i64, the state at the
+ *           start of the block, the first one starts at the origin in black
+ * trailer = index_offset:u64 blocks:u64 records:u64 steps:u64 "TRTLIDX1"
+ *
+ * steps count the moves and the lines, values are quantized to
+ * 1 / OUTPUT_ARCHIVE_SCALE, the precision of the text format, and clamped
+ * to +/-2^61
+ */
+
+#define OUTPUT_ARCHIVE_MAGIC "TRTLARC1"
+#define OUTPUT_ARCHIVE_INDEX_MAGIC "TRTLIDX1"
+#define OUTPUT_ARCHIVE_VERSION 1
+#define OUTPUT_ARCHIVE_BLOCK_RECORDS 65536
+#define OUTPUT_ARCHIVE_SCALE 1e6
+
+// the file is written front to back, "-" for stdout, NULL if the file can
+// not be opened
+struct output *output_archive_create(const char *path);
+
+/*
+ * stats: measure the drawing without writing anything
+ */
+
+struct output_stats {
+  size_t segments; // lines drawn
+  double length;   // total length of the lines
+  size_t colors;   // distinct colors of the lines
+  bool has_extent; // false if nothing is drawn
+  double min_x;    // bounding box of the lines
+  double min_y;
+  double max_x;
+  double max_y;
+};
+
+struct output *output_stats_create(void);
+// valid once the stage is finished
+const struct output_stats *output_stats_result(const struct output *self);
+void output_stats_write(const struct output *self, FILE *file); // as JSON
+
+// a span of records that may be accounted for several times, spans nest
+void output_stats_span_begin(struct output *self);
+// close the span as if it had been drawn count times, each copy moved by
+// (dx, dy) from the previous one, the span is counted once and false is
+// returned if the current color is not the one at its start
+bool output_stats_span_end(struct output *self, size_t count, double dx,
+                           double dy);
+
+/*
+ * pipeline: run the next stages on a writer thread
+ */
+
+// the records go through a ring of capacity records, rounded up to a power
+// of 2, finishing the stage waits for the writer to flush them, next if
+// the thread can not be started
+struct output *output_pipeline_create(struct output *next, size_t capacity);
+
+/*
+ * shm: hand the records to turtle-viewer through shared memory instead of
+ * formatting them on the pipe
+ *
+ * region = header ring, a POSIX shared memory object named on the pipe by
+ *          a single line "Shm NAME", the reader unlinks it and sets mapped
+ * header = "TRTLSHM1" capacity:u32 record_size:u32, at offset 64 head:u32
+ *          done:u32 reader_waiting:u32, at offset 128 tail:u32
+ *          writer_waiting:u32 mapped:u32, 192 bytes in all
+ * ring   = capacity records of 32 bytes, kind:u32 (an enum output_kind)
+ *          pad:u32 then the point x y or the color r g b as doubles
+ *
+ * values are in the byte order of the machine, head counts the records
+ * published by turtle and tail the records read by the viewer, modulo 2^32,
+ * a side waits on a futex on the counter of the other one when the ring is
+ * full or empty and sets its waiting word so that it is woken up
+ *
+ * turtle waits a few seconds for mapped when the ring is full and at the
+ * end, then drops the records and unlinks the region, so that another
+ * reader of the pipe does not block it
+ */
+
+#define OUTPUT_SHM_MAGIC "TRTLSHM1"
+#define OUTPUT_SHM_KEYWORD "Shm"
+#define OUTPUT_SHM_RECORDS 1048576
+
+// NULL if the file is not a pipe or if shared memory can not be used, the
+// text backend is the fallback then
+struct output *output_shm_create(FILE *pipe);
+
+/*
+ * simplify: drop redundant records before they reach the backend
+ */
+
+struct output_simplify_stats {
+  size_t records_in;
+  size_t records_out;
+  size_t duplicate_segments; // segments already drawn with the same color
+  size_t merged_segments;    // collinear segments merged into the previous one
+  size_t elided_moves;       // moves to the current position or overwritten
+  size_t elided_colors;      // colors equal to the current one or overwritten
+};
+
+struct output *output_simplify_create(struct output *next);
+const struct output_simplify_stats *
+output_simplify_stats(const struct output *self);
+
+#endif /* TURTLE_OUTPUT_H */
@@ -0,0 +1,775 @@
+#include "hasmap.h"
+#include "turtle-ast.h"
+#include "turtle-budget.h"
+#include "turtle-instance.h"
+#include "turtle-jit.h"
+#include "turtle-output.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * effects of the code, for the dependency analysis
+ */
+
+// names are the keys of the sets, they belong to the tree
+struct parallel_effects {
+  struct hashmap reads;  // variables read
+  struct hashmap writes; // variables set
+  struct hashmap calls;  // procedures called
+  bool random;           // uses the shared random generator
+};
+
+static void effects_create(struct parallel_effects *self) {
+  hashmap_create(&self->reads);
+  hashmap_create(&self->writes);
+  hashmap_create(&self->calls);
+  self->random = false;
+}
+
+static void effects_destroy(struct parallel_effects *self) {
+  hashmap_destroy(&self->reads);
+  hashmap_destroy(&self->writes);
+  hashmap_destroy(&self->calls);
+}
+
+static void set_add(struct hashmap *set, char *name) {
+  union hashmap_val_union val;
+  val.d = 0;
+  hashmap_set(set, name, val);
+}
+
+static bool set_contains(const struct hashmap *set, const char *name) {
+  return hashmap_get(set, name) != NULL;
+}
+
+// add every key of src to dst, minus the keys of except, true if dst grew
+static bool set_union(struct hashmap *dst, const struct hashmap *src,
+                      const struct hashmap *except) {
+  size_t count = dst->count;
+  for (size_t i = 0; i < src->size; ++i) {
+    for (struct hashmap_bucket *b = src->bucket_array[i]; b; b = b->next) {
+      if (!except || !set_contains(except, b->key)) {
+        set_add(dst, b->key);
+      }
+    }
+  }
+  return dst->count != count;
+}
+
+static bool set_intersects(const struct hashmap *a, const struct hashmap *b) {
+  for (size_t i = 0; i < a->size; ++i) {
+    for (struct hashmap_bucket *k = a->bucket_array[i]; k; k = k->next) {
+      if (set_contains(b, k->key)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool effects_union(struct parallel_effects *dst,
+                          const struct parallel_effects *src) {
+  bool changed = set_union(&dst->reads, &src->reads, NULL);
+  changed = set_union(&dst->writes, &src->writes, NULL) || changed;
+  changed = set_union(&dst->calls, &src->calls, NULL) || changed;
+  if (src->random && !dst->random) {
+    dst->random = true;
+    changed = true;
+  }
+  return changed;
+}
+
+// collect the direct effects of a node and of its children, a definition
+// of procedure does nothing until it is called
+static void effects_collect(struct parallel_effects *self,
+                            const struct ast_node *node) {
+  switch (node->kind) {
+  case KIND_EXPR_NAME:
+    set_add(&self->reads, node->u.name);
+    break;
+  case KIND_CMD_SET:
+    set_add(&self->writes, node->u.name);
+    break;
+  case KIND_CMD_CALL:
+    set_add(&self->calls, node->u.name);
+    break;
+  case KIND_CMD_PROC:
+    return;
+  case KIND_EXPR_FUNC:
+    if (node->u.func == FUNC_RANDOM) {
+      self->random = true;
+    }
+    break;
+  default:
+    break;
+  }
+  for (size_t i = 0; i < node->children_count; ++i) {
+    for (const struct ast_node *n = node->children[i]; n; n = n->next) {
+      effects_collect(self, n);
+    }
+  }
+}
+
+// whether a definition of procedure appears below the top level
+static bool has_nested_proc(const struct ast_node *node, bool nested) {
+  if (node->kind == KIND_CMD_PROC && nested) {
+    return true;
+  }
+  for (size_t i = 0; i < node->children_count; ++i) {
+    for (const struct ast_node *n = node->children[i]; n; n = n->next) {
+      if (has_nested_proc(n, true)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+/*
+ * procedures, defined at the top level only
+ */
+
+struct parallel_procs {
+  struct hashmap index; // name to index in effects, stored as a double
+  struct parallel_effects *effects;
+  size_t count;
+};
+
+static void procs_create(struct parallel_procs *self,
+                         const struct ast_node **stmts, size_t count) {
+  hashmap_create(&self->index);
+  self->effects = calloc(count ? count : 1, sizeof(struct parallel_effects));
+  self->count = 0;
+
+  for (size_t i = 0; i < count; ++i) {
+    if (stmts[i]->kind != KIND_CMD_PROC) {
+      continue;
+    }
+    union hashmap_val_union *val = hashmap_get(&self->index, stmts[i]->u.name);
+    size_t k;
+    if (val) {
+      k = (size_t)val->d;
+    } else {
+      k = self->count++;
+      union hashmap_val_union idx;
+      idx.d = k;
+      hashmap_set(&self->index, stmts[i]->u.name, idx);
+      effects_create(&self->effects[k]);
+    }
+    // every definition of a name may be the one that gets called
+    effects_collect(&self->effects[k], stmts[i]->children[0]);
+  }
+
+  // close the effects over the calls
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (size_t k = 0; k < self->count; ++k) {
+      struct parallel_effects callees;
+      effects_create(&callees);
+      const struct hashmap *calls = &self->effects[k].calls;
+      for (size_t i = 0; i < calls->size; ++i) {
+        for (struct hashmap_bucket *b = calls->bucket_array[i]; b;
+             b = b->next) {
+          union hashmap_val_union *val = hashmap_get(&self->index, b->key);
+          if (val) {
+            effects_union(&callees, &self->effects[(size_t)val->d]);
+          }
+        }
+      }
+      changed = effects_union(&self->effects[k], &callees) || changed;
+      effects_destroy(&callees);
+    }
+  }
+}
+
+static void procs_destroy(struct parallel_procs *self) {
+  for (size_t k = 0; k < self->count; ++k) {
+    effects_destroy(&self->effects[k]);
+  }
+  free(self->effects);
+  hashmap_destroy(&self->index);
+}
+
+// effects of a statement, including the procedures it calls
+static void procs_statement_effects(const struct parallel_procs *self,
+                                    struct parallel_effects *effects,
+                                    const struct ast_node *stmt) {
+  effects_collect(effects, stmt);
+  const struct hashmap *calls = &effects->calls;
+  struct parallel_effects callees;
+  effects_create(&callees);
+  for (size_t i = 0; i < calls->size; ++i) {
+    for (struct hashmap_bucket *b = calls->bucket_array[i]; b; b = b->next) {
+      union hashmap_val_union *val = hashmap_get(&self->index, b->key);
+      if (val) {
+        effects_union(&callees, &self->effects[(size_t)val->d]);
+      }
+    }
+  }
+  effects_union(effects, &callees);
+  effects_destroy(&callees);
+}
+
+/*
+ * sections
+ */
+
+enum {
+  POSE_X = 1 << 0,
+  POSE_Y = 1 << 1,
+  POSE_ANGLE = 1 << 2,
+  POSE_UP = 1 << 3,
+  POSE_ALL = POSE_X | POSE_Y | POSE_ANGLE | POSE_UP,
+};
+
+// whether the commands from stmts[i] set the whole pose of the turtle
+// before reading any part of it
+static bool establishes_pose(const struct ast_node **stmts, size_t count,
+                             size_t i) {
+  unsigned known = 0;
+  for (; i < count && known != POSE_ALL; ++i) {
+    const struct ast_node *stmt = stmts[i];
+    if (stmt->kind == KIND_CMD_SET || stmt->kind == KIND_CMD_PROC) {
+      continue;
+    }
+    if (stmt->kind != KIND_CMD_SIMPLE) {
+      return false;
+    }
+    switch (stmt->u.cmd) {
+    case CMD_HOME:
+      known = POSE_ALL;
+      break;
+    case CMD_UP:
+    case CMD_DOWN:
+      known |= POSE_UP;
+      break;
+    case CMD_HEADING:
+      known |= POSE_ANGLE;
+      break;
+    case CMD_POSITION:
+      // the record emitted depends on the pen
+      if (!(known & POSE_UP)) {
+        return false;
+      }
+      known |= POSE_X | POSE_Y;
+      break;
+    case CMD_COLOR:
+    case CMD_PRINT:
+      break;
+    default:
+      return false;
+    }
+  }
+  return known == POSE_ALL;
+}
+
+struct parallel_section {
+  size_t begin; // range of top-level statements
+  size_t end;
+  bool independent;
+
+  // only for independent sections, filled by a worker
+  struct context ctx;
+  char *log;
+  size_t log_size;
+  bool done;
+};
+
+struct parallel_job {
+  const struct ast_node **stmts;
+  struct parallel_section *sections;
+  size_t *queue; // independent sections, in order
+  size_t queue_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t next;
+  bool cancel;
+};
+
+static void section_eval(const struct parallel_job *job,
+                         struct parallel_section *section,
+                         struct context *ctx) {
+  for (size_t i = section->begin; i < section->end && !ctx->error; ++i) {
+    ast_node_eval_one(job->stmts[i], ctx);
+  }
+}
+
+static void *parallel_worker(void *arg) {
+  struct parallel_job *job = arg;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    if (job->cancel || job->next == job->queue_count) {
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    struct parallel_section *section = &job->sections[job->queue[job->next++]];
+    pthread_mutex_unlock(&job->lock);
+
+    section_eval(job, section, &section->ctx);
+    fclose(section->ctx.log);
+    section->ctx.log = NULL;
+
+    pthread_mutex_lock(&job->lock);
+    section->done = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+  }
+  return NULL;
+}
+
+static void copy_map(struct hashmap *dst, const struct hashmap *src) {
+  for (size_t i = 0; i < src->size; ++i) {
+    for (struct hashmap_bucket *b = src->bucket_array[i]; b; b = b->next) {
+      hashmap_set(dst, b->key, b->data);
+    }
+  }
+}
+
+// split the top-level statements and find the independent sections,
+// false if the program can not be split
+static bool parallel_plan(const struct ast_node **stmts, size_t count,
+                          struct parallel_section **sections,
+                          size_t *sections_count) {
+  for (size_t i = 0; i < count; ++i) {
+    if (has_nested_proc(stmts[i], false)) {
+      return false;
+    }
+  }
+
+  struct parallel_procs procs;
+  procs_create(&procs, stmts, count);
+
+  struct parallel_section *list = calloc(count, sizeof(*list));
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (i == 0 || establishes_pose(stmts, count, i)) {
+      list[n].begin = i;
+      list[n].independent = true;
+      ++n;
+    }
+    list[n - 1].end = i + 1;
+  }
+
+  struct hashmap written; // by the previous sections
+  hashmap_create(&written);
+  for (size_t k = 0; k < n; ++k) {
+    struct hashmap assigned; // by a top-level set of the section, so far
+    struct hashmap reads;    // before any top-level set of the section
+    hashmap_create(&assigned);
+    hashmap_create(&reads);
+    bool random = false;
+    struct parallel_effects all;
+    effects_create(&all);
+
+    for (size_t i = list[k].begin; i < list[k].end; ++i) {
+      struct parallel_effects effects;
+      effects_create(&effects);
+      procs_statement_effects(&procs, &effects, stmts[i]);
+      set_union(&reads, &effects.reads, &assigned);
+      random = random || effects.random;
+      effects_union(&all, &effects);
+      if (stmts[i]->kind == KIND_CMD_SET) {
+        set_add(&assigned, stmts[i]->u.name);
+      }
+      effects_destroy(&effects);
+    }
+
+    // the random generator is shared, its calls must stay in order
+    if (random || set_intersects(&reads, &written)) {
+      list[k].independent = false;
+    }
+    set_union(&written, &all.writes, NULL);
+
+    effects_destroy(&all);
+    hashmap_destroy(&reads);
+    hashmap_destroy(&assigned);
+  }
+  hashmap_destroy(&written);
+  procs_destroy(&procs);
+
+  *sections = list;
+  *sections_count = n;
+  return true;
+}
+
+void ast_eval_parallel(const struct ast *self, struct context *ctx,
+                       unsigned jobs) {
+  size_t count = 0;
+  for (const struct ast_node *n = self->unit; n; n = n->next) {
+    ++count;
+  }
+  const struct ast_node **stmts = calloc(count ? count : 1, sizeof(*stmts));
+  count = 0;
+  for (const struct ast_node *n = self->unit; n; n = n->next) {
+    stmts[count++] = n;
+  }
+
+  struct parallel_section *sections = NULL;
+  size_t sections_count = 0;
+  if (jobs == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = online > 0 ? online : 1;
+  }
+  // the counters and the trace of the metrics belong to a single context,
+  // and the bytes of a section are only written once it is merged
+  if (jobs <= 1 || ctx->metrics ||
+      (ctx->budget && ctx->budget->max_bytes > 0) ||
+      !parallel_plan(stmts, count, &sections, &sections_count)) {
+    free(stmts);
+    ast_eval(self, ctx);
+    return;
+  }
+
+  struct parallel_job job;
+  job.stmts = stmts;
+  job.sections = sections;
+  job.queue = calloc(sections_count, sizeof(size_t));
+  job.queue_count = 0;
+  job.next = 0;
+  job.cancel = false;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  // the procedures known when each section starts
+  struct hashmap procedures;
+  hashmap_create(&procedures);
+  for (size_t k = 0; k < sections_count; ++k) {
+    struct parallel_section *section = &sections[k];
+    if (section->independent) {
+      context_create(&section->ctx);
+      context_set_output(&section->ctx, output_buffer_create());
+      section->ctx.log = open_memstream(&section->log, &section->log_size);
+      copy_map(&section->ctx.procedures, &procedures);
+      if (!ctx->jit) {
+        jit_destroy(section->ctx.jit);
+        section->ctx.jit = NULL;
+      }
+      if (ctx->instances) {
+        section->ctx.instances = instances_create();
+      }
+      if (ctx->budget) {
+        budget_attach(ctx->budget, &section->ctx);
+      }
+      job.queue[job.queue_count++] = k;
+    }
+    for (size_t i = section->begin; i < section->end; ++i) {
+      if (stmts[i]->kind == KIND_CMD_PROC) {
+        union hashmap_val_union val;
+        val.ast_node = stmts[i]->children[0];
+        hashmap_set(&procedures, stmts[i]->u.name, val);
+      }
+    }
+  }
+  hashmap_destroy(&procedures);
+
+  unsigned threads = jobs < job.queue_count ? jobs : job.queue_count;
+  pthread_t *workers = calloc(threads ? threads : 1, sizeof(pthread_t));
+  unsigned started = 0;
+  while (started < threads &&
+         pthread_create(&workers[started], NULL, parallel_worker, &job) == 0) {
+    ++started;
+  }
+  // without any thread, the sections are evaluated here before the merge
+  if (started == 0) {
+    parallel_worker(&job);
+  }
+
+  // merge in program order, evaluating the dependent sections in place
+  for (size_t k = 0; k < sections_count && !ctx->error; ++k) {
+    struct parallel_section *section = &sections[k];
+    if (!section->independent) {
+      section_eval(&job, section, ctx);
+      continue;
+    }
+
+    pthread_mutex_lock(&job.lock);
+    while (!section->done) {
+      pthread_cond_wait(&job.cond, &job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    fwrite(section->log, 1, section->log_size, ctx->log);
+    output_buffer_replay(section->ctx.out, ctx->out);
+    ctx->x = section->ctx.x;
+    ctx->y = section->ctx.y;
+    ctx->angle = section->ctx.angle;
+    ctx->up = section->ctx.up;
+    ctx->error = section->ctx.error;
+    copy_map(&ctx->variables, &section->ctx.variables);
+    copy_map(&ctx->procedures, &section->ctx.procedures);
+  }
+
+  pthread_mutex_lock(&job.lock);
+  job.cancel = true;
+  pthread_mutex_unlock(&job.lock);
+  for (unsigned i = 0; i < started; ++i) {
+    pthread_join(workers[i], NULL);
+  }
+
+  for (size_t k = 0; k < sections_count; ++k) {
+    struct parallel_section *section = &sections[k];
+    if (section->independent) {
+      if (section->ctx.log) {
+        fclose(section->ctx.log);
+      }
+      free(section->log);
+      context_destroy(&section->ctx);
+    }
+  }
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  free(workers);
+  free(job.queue);
+  free(sections);
+  free(stmts);
+}
+
+/*
+ * repeat loops
+ *
+ * not a parallel scan: the pose at the start of each block of iterations
+ * is computed in place by running the loop without any output, only the
+ * records are produced in parallel, the workers evaluate the blocks again
+ * from these poses into their own buffer, with the same arithmetic, and
+ * format them there, then the buffers are written in order
+ */
+
+// records drawn by the iterations of a block
+#define SCAN_BLOCK_RECORDS 65536
+// shorter loops are run in place
+#define SCAN_MIN_RECORDS (4 * SCAN_BLOCK_RECORDS)
+// blocks evaluated ahead of the one being written, per worker
+#define SCAN_WINDOW 4
+
+struct scan_block {
+  int count; // iterations
+
+  // the pose before the first iteration
+  double x;
+  double y;
+  double angle;
+  bool up;
+
+  struct output *out; // the text of the records, or the records
+  FILE *file;         // the memory stream of the text, NULL for records
+  char *text;
+  size_t size;
+  bool done;
+};
+
+struct scan_job {
+  const struct ast_node *node;
+  struct scan_block *blocks;
+  size_t blocks_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  size_t known;   // blocks whose pose is known
+  size_t next;    // next block to evaluate
+  size_t written; // blocks written to the output
+  size_t window;
+};
+
+struct scan_worker {
+  struct scan_job *job;
+  struct context ctx;
+  pthread_t thread;
+};
+
+// counts the records of the first iteration on their way to the output
+struct scan_counter {
+  struct output base;
+  size_t records;
+};
+
+static void scan_count(struct output *self, const struct output_record *rec) {
+  struct scan_counter *counter = (struct scan_counter *)self;
+  counter->records++;
+  output_emit(self->next, rec);
+}
+
+static void scan_discard(struct output *self,
+                         const struct output_record *rec) {
+  (void)self;
+  (void)rec;
+}
+
+static void *scan_worker(void *arg) {
+  struct scan_worker *worker = arg;
+  struct scan_job *job = worker->job;
+  struct context *ctx = &worker->ctx;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    while (job->next < job->blocks_count &&
+           (job->next >= job->known ||
+            job->next >= job->written + job->window)) {
+      pthread_cond_wait(&job->cond, &job->lock);
+    }
+    if (job->next == job->blocks_count) {
+      pthread_mutex_unlock(&job->lock);
+      break;
+    }
+    struct scan_block *block = &job->blocks[job->next++];
+    pthread_mutex_unlock(&job->lock);
+
+    ctx->x = block->x;
+    ctx->y = block->y;
+    ctx->angle = block->angle;
+    ctx->up = block->up;
+    ctx->out = block->out;
+    ast_repeat_iterate(job->node, ctx, block->count);
+    ctx->out = NULL;
+
+    pthread_mutex_lock(&job->lock);
+    block->done = true;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+  }
+  return NULL;
+}
+
+static void scan_write(struct scan_block *block, struct output *out) {
+  FILE *file = output_text_file(out);
+  if (block->file) {
+    fclose(block->file);
+    fwrite(block->text, 1, block->size, file);
+    out->bytes += block->size;
+    free(block->text);
+  } else {
+    output_buffer_replay(block->out, out);
+  }
+  output_destroy(block->out);
+}
+
+// write the evaluated blocks in order, waiting for the last ones if wait is
+// set
+static void scan_flush(struct scan_job *job, struct output *out, bool wait) {
+  pthread_mutex_lock(&job->lock);
+  while (job->written < job->blocks_count) {
+    struct scan_block *block = &job->blocks[job->written];
+    if (!block->done) {
+      if (!wait) {
+        break;
+      }
+      pthread_cond_wait(&job->cond, &job->lock);
+      continue;
+    }
+    pthread_mutex_unlock(&job->lock);
+    scan_write(block, out);
+    pthread_mutex_lock(&job->lock);
+    job->written++;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+}
+
+int ast_repeat_scan(const struct ast_node *self, struct context *ctx,
+                    int count) {
+  // the first iteration runs in place, with the errors the others would
+  // have, and tells how much the body draws
+  struct scan_counter counter;
+  memset(&counter, 0, sizeof(counter));
+  counter.base.emit = scan_count;
+  counter.base.next = ctx->out;
+  ctx->out = &counter.base;
+  ast_repeat_iterate(self, ctx, 1);
+  ctx->out = counter.base.next;
+
+  size_t remaining = count - 1;
+  if (ctx->error || counter.records == 0 ||
+      remaining * counter.records < SCAN_MIN_RECORDS) {
+    return 1;
+  }
+
+  size_t per_block = SCAN_BLOCK_RECORDS / counter.records;
+  if (per_block == 0) {
+    per_block = 1;
+  }
+
+  struct scan_job job;
+  job.node = self;
+  job.blocks_count = (remaining + per_block - 1) / per_block;
+  job.blocks = calloc(job.blocks_count, sizeof(struct scan_block));
+  job.known = 0;
+  job.next = 0;
+  job.written = 0;
+  job.window = SCAN_WINDOW * ctx->threads;
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  unsigned started = 0;
+  struct scan_worker *workers =
+      calloc(ctx->threads, sizeof(struct scan_worker));
+  for (unsigned i = 0; i < ctx->threads; ++i) {
+    struct scan_worker *worker = &workers[started];
+    worker->job = &job;
+    context_create(&worker->ctx);
+    context_set_output(&worker->ctx, NULL);
+    worker->ctx.log = ctx->log;
+    copy_map(&worker->ctx.variables, &ctx->variables);
+    if (!ctx->jit) {
+      jit_destroy(worker->ctx.jit);
+      worker->ctx.jit = NULL;
+    }
+    if (pthread_create(&worker->thread, NULL, scan_worker, worker) != 0) {
+      context_destroy(&worker->ctx);
+      break;
+    }
+    ++started;
+  }
+
+  int ran = 1;
+  if (started > 0) {
+    // the poses, computed as the loop would in place
+    struct output discard;
+    memset(&discard, 0, sizeof(discard));
+    discard.emit = scan_discard;
+    struct output *out = ctx->out;
+    bool text = output_text_file(out) != NULL;
+    ctx->out = &discard;
+
+    for (size_t b = 0; b < job.blocks_count; ++b) {
+      struct scan_block *block = &job.blocks[b];
+      block->count = remaining < per_block ? remaining : per_block;
+      remaining -= block->count;
+      block->x = ctx->x;
+      block->y = ctx->y;
+      block->angle = ctx->angle;
+      block->up = ctx->up;
+      if (text) {
+        block->file = open_memstream(&block->text, &block->size);
+      }
+      block->out = block->file ? output_text_create(block->file)
+                               : output_buffer_create();
+
+      pthread_mutex_lock(&job.lock);
+      job.known = b + 1;
+      pthread_cond_broadcast(&job.cond);
+      pthread_mutex_unlock(&job.lock);
+
+      scan_flush(&job, out, false);
+      ast_repeat_iterate(self, ctx, block->count);
+    }
+
+    ctx->out = out;
+    scan_flush(&job, out, true);
+    ran = count;
+  }
+
+  for (unsigned i = 0; i < started; ++i) {
+    pthread_join(workers[i].thread, NULL);
+    ctx->error = ctx->error || workers[i].ctx.error;
+    context_destroy(&workers[i].ctx);
+  }
+  pthread_cond_destroy(&job.cond);
+  pthread_mutex_destroy(&job.lock);
+  free(workers);
+  free(job.blocks);
+  return ran;
+}
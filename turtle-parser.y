@@ -61,7 +61,7 @@ void yyerror(struct ast *ret, const char *);
 %token            KW_GRAY     "gray"
 %token            KW_WHITE    "white"
 
-%type <node> unit cmds cmd expr
+%type <node> cmds cmd expr
 
 %left '+' '-'
 %left '*' '/'
@@ -71,7 +71,8 @@ void yyerror(struct ast *ret, const char *);
 %%
 
 unit:
-    cmds                                { $$ = $1; ret->unit = $$; }
+    unit cmd                            { ast_append(ret, $2); }
+  | /* empty */
 ;
 
 cmds:
@@ -0,0 +1,193 @@
+#include "turtle-output.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+// records published or released at once
+#define PIPELINE_BATCH 256
+// keeps the indices of each side on their own cache line
+#define PIPELINE_CACHE_LINE 64
+
+// single producer, single consumer ring: the evaluation only writes head
+// and the writer thread only writes tail, they sleep on the condition
+// variables only when the ring is full or empty
+struct output_pipeline {
+  struct output base;
+  struct output_record *ring;
+  size_t mask; // capacity - 1, the capacity is a power of 2
+  size_t batch;
+  pthread_t thread;
+  bool running;
+
+  pthread_mutex_t lock;
+  pthread_cond_t not_full;
+  pthread_cond_t not_empty;
+
+  char pad0[PIPELINE_CACHE_LINE];
+  // shared, sequentially consistent so that a side going to sleep and the
+  // other one publishing can not miss each other
+  size_t head; // records published
+  bool done;   // no record will be published anymore
+  bool writer_waiting;
+
+  char pad1[PIPELINE_CACHE_LINE];
+  size_t tail; // records written
+  bool producer_waiting;
+
+  char pad2[PIPELINE_CACHE_LINE];
+  // owned by the evaluation
+  size_t written;   // records in the ring, some maybe not published yet
+  size_t published; // last value of head
+  size_t seen_tail; // last value of tail read
+};
+
+static size_t pipeline_load(const size_t *v) {
+  return __atomic_load_n(v, __ATOMIC_SEQ_CST);
+}
+
+static void pipeline_store(size_t *v, size_t value) {
+  __atomic_store_n(v, value, __ATOMIC_SEQ_CST);
+}
+
+static bool pipeline_load_flag(const bool *v) {
+  return __atomic_load_n(v, __ATOMIC_SEQ_CST);
+}
+
+static void pipeline_store_flag(bool *v, bool value) {
+  __atomic_store_n(v, value, __ATOMIC_SEQ_CST);
+}
+
+// wake the other side if it sleeps, after the index it waits for changed
+static void pipeline_wake(struct output_pipeline *self, const bool *waiting,
+                          pthread_cond_t *cond) {
+  if (pipeline_load_flag(waiting)) {
+    pthread_mutex_lock(&self->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&self->lock);
+  }
+}
+
+static void pipeline_publish(struct output_pipeline *self) {
+  if (self->published != self->written) {
+    self->published = self->written;
+    pipeline_store(&self->head, self->written);
+    pipeline_wake(self, &self->writer_waiting, &self->not_empty);
+  }
+}
+
+static void *pipeline_writer(void *arg) {
+  struct output_pipeline *self = arg;
+  size_t tail = 0;
+  for (;;) {
+    size_t head = pipeline_load(&self->head);
+    if (head == tail) {
+      pthread_mutex_lock(&self->lock);
+      pipeline_store_flag(&self->writer_waiting, true);
+      while ((head = pipeline_load(&self->head)) == tail &&
+             !pipeline_load_flag(&self->done)) {
+        pthread_cond_wait(&self->not_empty, &self->lock);
+      }
+      pipeline_store_flag(&self->writer_waiting, false);
+      pthread_mutex_unlock(&self->lock);
+      if (head == tail) {
+        break; // done, head is final once done is set
+      }
+    }
+
+    while (tail != head) {
+      output_emit(self->base.next, &self->ring[tail & self->mask]);
+      if (++tail % self->batch == 0) {
+        pipeline_store(&self->tail, tail);
+        pipeline_wake(self, &self->producer_waiting, &self->not_full);
+      }
+    }
+    pipeline_store(&self->tail, tail);
+    pipeline_wake(self, &self->producer_waiting, &self->not_full);
+  }
+  return NULL;
+}
+
+static void output_pipeline_emit(struct output *base,
+                                 const struct output_record *rec) {
+  struct output_pipeline *self = (struct output_pipeline *)base;
+  if (self->written - self->seen_tail > self->mask) {
+    self->seen_tail = pipeline_load(&self->tail);
+    if (self->written - self->seen_tail > self->mask) {
+      pipeline_publish(self);
+      pthread_mutex_lock(&self->lock);
+      pipeline_store_flag(&self->producer_waiting, true);
+      while (self->written - (self->seen_tail = pipeline_load(&self->tail)) >
+             self->mask) {
+        pthread_cond_wait(&self->not_full, &self->lock);
+      }
+      pipeline_store_flag(&self->producer_waiting, false);
+      pthread_mutex_unlock(&self->lock);
+    }
+  }
+
+  self->ring[self->written & self->mask] = *rec;
+  if (++self->written - self->published >= self->batch) {
+    pipeline_publish(self);
+  }
+}
+
+// hand over the last records and wait for the writer to write them all
+static void pipeline_stop(struct output_pipeline *self) {
+  if (!self->running) {
+    return;
+  }
+  pipeline_publish(self);
+  pthread_mutex_lock(&self->lock);
+  pipeline_store_flag(&self->done, true);
+  pthread_cond_signal(&self->not_empty);
+  pthread_mutex_unlock(&self->lock);
+  pthread_join(self->thread, NULL);
+  self->running = false;
+}
+
+static bool output_pipeline_finish(struct output *base) {
+  pipeline_stop((struct output_pipeline *)base);
+  return true;
+}
+
+static void output_pipeline_destroy(struct output *base) {
+  struct output_pipeline *self = (struct output_pipeline *)base;
+  pipeline_stop(self);
+  pthread_cond_destroy(&self->not_empty);
+  pthread_cond_destroy(&self->not_full);
+  pthread_mutex_destroy(&self->lock);
+  free(self->ring);
+  free(self);
+}
+
+struct output *output_pipeline_create(struct output *next, size_t capacity) {
+  size_t size = 2;
+  while (size < capacity) {
+    size *= 2;
+  }
+
+  struct output_pipeline *self = calloc(1, sizeof(struct output_pipeline));
+  self->base.emit = output_pipeline_emit;
+  self->base.finish = output_pipeline_finish;
+  self->base.destroy = output_pipeline_destroy;
+  self->base.next = next;
+  self->ring = malloc(size * sizeof(struct output_record));
+  self->mask = size - 1;
+  self->batch = size / 4 < PIPELINE_BATCH ? size / 4 : PIPELINE_BATCH;
+  if (self->batch == 0) {
+    self->batch = 1;
+  }
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->not_full, NULL);
+  pthread_cond_init(&self->not_empty, NULL);
+
+  // without a writer, the records are written by the evaluation
+  self->running =
+      pthread_create(&self->thread, NULL, pipeline_writer, self) == 0;
+  if (!self->running) {
+    output_pipeline_destroy(&self->base);
+    return next;
+  }
+  return &self->base;
+}
@@ -0,0 +1,537 @@
+#include "turtle-output.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RASTER_TILE 64
+#define RASTER_MARGIN 0.05
+#define RASTER_SQRT1_2 0.70710678118654752440
+
+// a segment in world coordinates, with its packed 0xRRGGBB color
+struct raster_segment {
+  float x0;
+  float y0;
+  float x1;
+  float y1;
+  uint32_t color;
+};
+
+struct output_raster {
+  struct output base;
+  struct output_raster_options opts;
+  char *path;
+
+  double x; // current position
+  double y;
+  uint32_t color;
+
+  struct raster_segment *segments;
+  size_t count;
+  size_t capacity;
+
+  double min_x; // bounding box of the segments
+  double min_y;
+  double max_x;
+  double max_y;
+};
+
+static uint32_t raster_channel(double v) {
+  if (!(v > 0)) {
+    return 0;
+  }
+  if (v >= 1) {
+    return 255;
+  }
+  return (uint32_t)lround(v * 255);
+}
+
+static void output_raster_emit(struct output *base,
+                               const struct output_record *rec) {
+  struct output_raster *self = (struct output_raster *)base;
+  switch (rec->kind) {
+  case OUTPUT_MOVE_TO:
+    self->x = rec->u.point.x;
+    self->y = rec->u.point.y;
+    break;
+
+  case OUTPUT_LINE_TO: {
+    if (self->count == self->capacity) {
+      self->capacity = self->capacity ? 2 * self->capacity : 1024;
+      self->segments = realloc(self->segments, self->capacity *
+                                                   sizeof(struct raster_segment));
+    }
+    struct raster_segment *s = &self->segments[self->count++];
+    s->x0 = self->x;
+    s->y0 = self->y;
+    s->x1 = rec->u.point.x;
+    s->y1 = rec->u.point.y;
+    s->color = self->color;
+    self->min_x = fmin(self->min_x, fmin(s->x0, s->x1));
+    self->min_y = fmin(self->min_y, fmin(s->y0, s->y1));
+    self->max_x = fmax(self->max_x, fmax(s->x0, s->x1));
+    self->max_y = fmax(self->max_y, fmax(s->y0, s->y1));
+    self->x = rec->u.point.x;
+    self->y = rec->u.point.y;
+    break;
+  }
+
+  case OUTPUT_COLOR:
+    self->color = raster_channel(rec->u.color.r) << 16 |
+                  raster_channel(rec->u.color.g) << 8 |
+                  raster_channel(rec->u.color.b);
+    break;
+  }
+}
+
+/*
+ * tiling
+ */
+
+// the work shared by the threads, segments are in pixel coordinates
+struct raster_job {
+  const struct output_raster *raster;
+  struct raster_segment *segments;
+  size_t count;
+  double half_width;
+
+  unsigned tiles_x;
+  unsigned tiles_y;
+  size_t tiles;
+
+  unsigned threads;
+  size_t *offsets; // per (tile, thread), start of the thread bin in indices
+  uint32_t *indices;
+
+  uint8_t *pixels; // RGB, row major
+
+  pthread_mutex_t lock;
+  size_t next_tile;
+};
+
+struct raster_worker {
+  struct raster_job *job;
+  unsigned id;
+  pthread_t thread;
+  bool started; // false if the thread could not be created
+};
+
+// the range of tiles touched by the segment, inclusive
+static void raster_segment_tiles(const struct raster_job *job,
+                                 const struct raster_segment *s, long *tx0,
+                                 long *ty0, long *tx1, long *ty1) {
+  double pad = job->half_width + 1;
+  *tx0 = (long)floor((fmin(s->x0, s->x1) - pad) / RASTER_TILE);
+  *ty0 = (long)floor((fmin(s->y0, s->y1) - pad) / RASTER_TILE);
+  *tx1 = (long)floor((fmax(s->x0, s->x1) + pad) / RASTER_TILE);
+  *ty1 = (long)floor((fmax(s->y0, s->y1) + pad) / RASTER_TILE);
+  *tx0 = *tx0 < 0 ? 0 : *tx0;
+  *ty0 = *ty0 < 0 ? 0 : *ty0;
+  *tx1 = *tx1 >= (long)job->tiles_x ? (long)job->tiles_x - 1 : *tx1;
+  *ty1 = *ty1 >= (long)job->tiles_y ? (long)job->tiles_y - 1 : *ty1;
+}
+
+// whether the segment passes close enough to the tile to cover a pixel of it
+static bool raster_segment_hits_tile(const struct raster_job *job,
+                                     const struct raster_segment *s, long tx,
+                                     long ty) {
+  double cx = (tx + 0.5) * RASTER_TILE;
+  double cy = (ty + 0.5) * RASTER_TILE;
+  double dx = s->x1 - s->x0;
+  double dy = s->y1 - s->y0;
+  double len2 = dx * dx + dy * dy;
+  double t = len2 > 0 ? ((cx - s->x0) * dx + (cy - s->y0) * dy) / len2 : 0;
+  t = t < 0 ? 0 : (t > 1 ? 1 : t);
+  double d = hypot(s->x0 + t * dx - cx, s->y0 + t * dy - cy);
+  return d <= RASTER_TILE * RASTER_SQRT1_2 + job->half_width + 1;
+}
+
+// visit every tile touched by the segments of the thread, counting them or
+// appending the segment to the bins
+static void raster_bin(struct raster_job *job, unsigned id, bool fill) {
+  size_t begin = job->count * id / job->threads;
+  size_t end = job->count * (id + 1) / job->threads;
+  for (size_t i = begin; i < end; ++i) {
+    const struct raster_segment *s = &job->segments[i];
+    long tx0, ty0, tx1, ty1;
+    raster_segment_tiles(job, s, &tx0, &ty0, &tx1, &ty1);
+    bool small = tx1 - tx0 <= 1 && ty1 - ty0 <= 1;
+    for (long ty = ty0; ty <= ty1; ++ty) {
+      for (long tx = tx0; tx <= tx1; ++tx) {
+        if (!small && !raster_segment_hits_tile(job, s, tx, ty)) {
+          continue;
+        }
+        size_t *offset =
+            &job->offsets[((size_t)ty * job->tiles_x + tx) * job->threads + id];
+        if (fill) {
+          job->indices[(*offset)++] = i;
+        } else {
+          (*offset)++;
+        }
+      }
+    }
+  }
+}
+
+static void raster_tile(struct raster_job *job, size_t tile) {
+  float acc[RASTER_TILE][RASTER_TILE][3];
+  for (size_t y = 0; y < RASTER_TILE; ++y) {
+    for (size_t x = 0; x < RASTER_TILE; ++x) {
+      acc[y][x][0] = acc[y][x][1] = acc[y][x][2] = 1.0f;
+    }
+  }
+
+  long tx = tile % job->tiles_x;
+  long ty = tile / job->tiles_x;
+  long px0 = tx * RASTER_TILE;
+  long py0 = ty * RASTER_TILE;
+  long pw = job->raster->opts.width - px0;
+  long ph = job->raster->opts.height - py0;
+  pw = pw > RASTER_TILE ? RASTER_TILE : pw;
+  ph = ph > RASTER_TILE ? RASTER_TILE : ph;
+
+  // after filling, offsets point at the end of each bin
+  size_t first = tile * job->threads;
+  size_t begin = first == 0 ? 0 : job->offsets[first - 1];
+  size_t end = job->offsets[first + job->threads - 1];
+  double hw = job->half_width;
+
+  for (size_t k = begin; k < end; ++k) {
+    const struct raster_segment *s = &job->segments[job->indices[k]];
+    float r = (s->color >> 16 & 0xFF) / 255.0f;
+    float g = (s->color >> 8 & 0xFF) / 255.0f;
+    float b = (s->color & 0xFF) / 255.0f;
+
+    long x0 = (long)floor(fmin(s->x0, s->x1) - hw - 1) - px0;
+    long y0 = (long)floor(fmin(s->y0, s->y1) - hw - 1) - py0;
+    long x1 = (long)ceil(fmax(s->x0, s->x1) + hw + 1) - px0;
+    long y1 = (long)ceil(fmax(s->y0, s->y1) + hw + 1) - py0;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    x1 = x1 > pw ? pw : x1;
+    y1 = y1 > ph ? ph : y1;
+
+    double dx = s->x1 - s->x0;
+    double dy = s->y1 - s->y0;
+    double len2 = dx * dx + dy * dy;
+
+    double reach = (hw + 0.5) * sqrt(len2);
+
+    for (long y = y0; y < y1; ++y) {
+      double cy = py0 + y + 0.5 - s->y0;
+      // only the pixels in the band around the supporting line can be covered
+      long xa = x0, xb = x1;
+      if (fabs(dy) > 1e-9) {
+        double u = (cy * dx - reach) / dy + s->x0 - px0 - 0.5;
+        double v = (cy * dx + reach) / dy + s->x0 - px0 - 0.5;
+        xa = fmax(xa, floor(fmin(u, v)));
+        xb = fmin(xb, ceil(fmax(u, v)) + 1);
+      }
+      for (long x = xa; x < xb; ++x) {
+        double cx = px0 + x + 0.5 - s->x0;
+        double t = len2 > 0 ? (cx * dx + cy * dy) / len2 : 0;
+        t = t < 0 ? 0 : (t > 1 ? 1 : t);
+        double ex = cx - t * dx;
+        double ey = cy - t * dy;
+        // coverage of a pixel by a line with round caps, one pixel ramp
+        double a = hw + 0.5 - sqrt(ex * ex + ey * ey);
+        if (a <= 0) {
+          continue;
+        }
+        float alpha = a >= 1 ? 1.0f : (float)a;
+        acc[y][x][0] += (r - acc[y][x][0]) * alpha;
+        acc[y][x][1] += (g - acc[y][x][1]) * alpha;
+        acc[y][x][2] += (b - acc[y][x][2]) * alpha;
+      }
+    }
+  }
+
+  for (long y = 0; y < ph; ++y) {
+    uint8_t *row =
+        job->pixels + ((size_t)(py0 + y) * job->raster->opts.width + px0) * 3;
+    for (long x = 0; x < pw; ++x) {
+      for (int c = 0; c < 3; ++c) {
+        row[3 * x + c] = (uint8_t)lroundf(acc[y][x][c] * 255.0f);
+      }
+    }
+  }
+}
+
+static void *raster_worker_bin(void *arg) {
+  struct raster_worker *worker = arg;
+  raster_bin(worker->job, worker->id, false);
+  return NULL;
+}
+
+static void *raster_worker_fill(void *arg) {
+  struct raster_worker *worker = arg;
+  raster_bin(worker->job, worker->id, true);
+  return NULL;
+}
+
+static void *raster_worker_draw(void *arg) {
+  struct raster_worker *worker = arg;
+  struct raster_job *job = worker->job;
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    size_t tile = job->next_tile++;
+    pthread_mutex_unlock(&job->lock);
+    if (tile >= job->tiles) {
+      break;
+    }
+    raster_tile(job, tile);
+  }
+  return NULL;
+}
+
+static void raster_run(struct raster_worker *workers, unsigned count,
+                       void *(*fn)(void *)) {
+  for (unsigned i = 1; i < count; ++i) {
+    workers[i].started =
+        pthread_create(&workers[i].thread, NULL, fn, &workers[i]) == 0;
+  }
+  fn(&workers[0]);
+  // the share of a thread that could not be created is done here
+  for (unsigned i = 1; i < count; ++i) {
+    if (workers[i].started) {
+      pthread_join(workers[i].thread, NULL);
+    } else {
+      fn(&workers[i]);
+    }
+  }
+}
+
+/*
+ * image files
+ */
+
+static uint32_t raster_crc_table[256];
+
+static void raster_crc_init(void) {
+  for (uint32_t n = 0; n < 256; ++n) {
+    uint32_t c = n;
+    for (int k = 0; k < 8; ++k) {
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    }
+    raster_crc_table[n] = c;
+  }
+}
+
+static uint32_t raster_crc(uint32_t crc, const uint8_t *buf, size_t len) {
+  crc = ~crc;
+  for (size_t i = 0; i < len; ++i) {
+    crc = raster_crc_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static void raster_put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static void raster_png_chunk(FILE *file, const char *type, const uint8_t *data,
+                             size_t len) {
+  uint8_t header[8];
+  raster_put32(header, len);
+  memcpy(header + 4, type, 4);
+  uint32_t crc = raster_crc(0, header + 4, 4);
+  crc = raster_crc(crc, data, len);
+  uint8_t footer[4];
+  raster_put32(footer, crc);
+  fwrite(header, 1, 8, file);
+  fwrite(data, 1, len, file);
+  fwrite(footer, 1, 4, file);
+}
+
+// PNG with a zlib stream made of stored blocks, so no compression library
+// is needed
+static void raster_write_png(FILE *file, const uint8_t *pixels, unsigned w,
+                             unsigned h) {
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A,
+                                       '\n'};
+  fwrite(signature, 1, 8, file);
+
+  uint8_t ihdr[13];
+  raster_put32(ihdr, w);
+  raster_put32(ihdr + 4, h);
+  ihdr[8] = 8;  // bit depth
+  ihdr[9] = 2;  // truecolor
+  ihdr[10] = 0; // deflate
+  ihdr[11] = 0; // adaptive filtering
+  ihdr[12] = 0; // no interlace
+  raster_png_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+  size_t stride = (size_t)w * 3 + 1;
+  size_t raw = stride * h;
+  size_t blocks = (raw + 0xFFFF - 1) / 0xFFFF;
+  size_t len = 2 + raw + 5 * blocks + 4;
+  uint8_t *z = malloc(len);
+  uint8_t *p = z;
+  *p++ = 0x78;
+  *p++ = 0x01;
+
+  uint32_t a = 1, b = 0; // adler32
+  size_t row = 0, col = 0;
+  for (size_t left = raw; left > 0;) {
+    size_t n = left > 0xFFFF ? 0xFFFF : left;
+    left -= n;
+    *p++ = left == 0;
+    *p++ = n & 0xFF;
+    *p++ = n >> 8;
+    *p++ = ~n & 0xFF;
+    *p++ = (~n >> 8) & 0xFF;
+    for (size_t i = 0; i < n; ++i) {
+      uint8_t byte = col == 0 ? 0 : pixels[row * (stride - 1) + col - 1];
+      if (++col == stride) {
+        col = 0;
+        ++row;
+      }
+      *p++ = byte;
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  raster_put32(p, b << 16 | a);
+
+  static const size_t chunk = 1 << 20;
+  for (size_t off = 0; off < len; off += chunk) {
+    raster_png_chunk(file, "IDAT", z + off, len - off > chunk ? chunk : len - off);
+  }
+  free(z);
+  raster_png_chunk(file, "IEND", NULL, 0);
+}
+
+static void raster_write_ppm(FILE *file, const uint8_t *pixels, unsigned w,
+                             unsigned h) {
+  fprintf(file, "P6\n%u %u\n255\n", w, h);
+  fwrite(pixels, 3, (size_t)w * h, file);
+}
+
+static bool raster_is_png(const char *path) {
+  size_t len = strlen(path);
+  return len >= 4 && strcmp(path + len - 4, ".png") == 0;
+}
+
+static bool output_raster_finish(struct output *base) {
+  struct output_raster *self = (struct output_raster *)base;
+  unsigned w = self->opts.width;
+  unsigned h = self->opts.height;
+
+  // fit the bounding box in the image, keeping the aspect ratio
+  double bw = self->max_x - self->min_x;
+  double bh = self->max_y - self->min_y;
+  double scale = 1;
+  if (self->count > 0 && (bw > 0 || bh > 0)) {
+    double sx = bw > 0 ? w * (1 - 2 * RASTER_MARGIN) / bw : INFINITY;
+    double sy = bh > 0 ? h * (1 - 2 * RASTER_MARGIN) / bh : INFINITY;
+    scale = fmin(sx, sy);
+  }
+  double cx = (self->min_x + self->max_x) / 2;
+  double cy = (self->min_y + self->max_y) / 2;
+  for (size_t i = 0; i < self->count; ++i) {
+    struct raster_segment *s = &self->segments[i];
+    s->x0 = (s->x0 - cx) * scale + w / 2.0;
+    s->y0 = (s->y0 - cy) * scale + h / 2.0;
+    s->x1 = (s->x1 - cx) * scale + w / 2.0;
+    s->y1 = (s->y1 - cy) * scale + h / 2.0;
+  }
+
+  struct raster_job job;
+  job.raster = self;
+  job.segments = self->segments;
+  job.count = self->count;
+  job.half_width = self->opts.line_width / 2;
+  job.tiles_x = (w + RASTER_TILE - 1) / RASTER_TILE;
+  job.tiles_y = (h + RASTER_TILE - 1) / RASTER_TILE;
+  job.tiles = (size_t)job.tiles_x * job.tiles_y;
+  job.threads = self->opts.threads;
+  if (job.threads == 0) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    job.threads = n > 0 ? n : 1;
+  }
+  job.offsets = calloc(job.tiles * job.threads, sizeof(size_t));
+  job.pixels = malloc((size_t)w * h * 3);
+  pthread_mutex_init(&job.lock, NULL);
+  job.next_tile = 0;
+
+  struct raster_worker *workers =
+      calloc(job.threads, sizeof(struct raster_worker));
+  for (unsigned i = 0; i < job.threads; ++i) {
+    workers[i].job = &job;
+    workers[i].id = i;
+  }
+
+  // count, then turn the counts into offsets so that each tile lists its
+  // segments in program order, then fill, then draw
+  raster_run(workers, job.threads, raster_worker_bin);
+  size_t total = 0;
+  for (size_t i = 0; i < job.tiles * job.threads; ++i) {
+    size_t n = job.offsets[i];
+    job.offsets[i] = total;
+    total += n;
+  }
+  job.indices = malloc((total ? total : 1) * sizeof(uint32_t));
+  raster_run(workers, job.threads, raster_worker_fill);
+  raster_run(workers, job.threads, raster_worker_draw);
+
+  bool ok = true;
+  FILE *file = fopen(self->path, "wb");
+  if (!file) {
+    perror(self->path);
+    ok = false;
+  } else {
+    if (raster_is_png(self->path)) {
+      raster_write_png(file, job.pixels, w, h);
+    } else {
+      raster_write_ppm(file, job.pixels, w, h);
+    }
+    long end = ftell(file);
+    self->base.bytes = end > 0 ? end : 0;
+    if (fclose(file) != 0) {
+      perror(self->path);
+      ok = false;
+    }
+  }
+
+  pthread_mutex_destroy(&job.lock);
+  free(workers);
+  free(job.indices);
+  free(job.offsets);
+  free(job.pixels);
+  return ok;
+}
+
+static void output_raster_destroy(struct output *base) {
+  struct output_raster *self = (struct output_raster *)base;
+  free(self->segments);
+  free(self->path);
+  free(self);
+}
+
+struct output *output_raster_create(const struct output_raster_options *opts) {
+  static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+  pthread_once(&crc_once, raster_crc_init);
+
+  struct output_raster *self = calloc(1, sizeof(struct output_raster));
+  self->base.emit = output_raster_emit;
+  self->base.finish = output_raster_finish;
+  self->base.destroy = output_raster_destroy;
+  self->base.next = NULL;
+  self->opts = *opts;
+  self->path = strdup(opts->path);
+  self->opts.path = self->path;
+  self->min_x = self->min_y = INFINITY;
+  self->max_x = self->max_y = -INFINITY;
+  // the image is only written once finished, its pixels are counted from the
+  // start so that a budget on the bytes can stop the evaluation
+  self->base.bytes = (size_t)opts->width * opts->height * 3;
+  return &self->base;
+}
@@ -0,0 +1,272 @@
+#define _DEFAULT_SOURCE
+#include "turtle-output.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#define SHM_SUPPORTED 1
+#else
+#define SHM_SUPPORTED 0
+#endif
+
+#if SHM_SUPPORTED
+
+// records published or released at once
+#define SHM_BATCH 256
+// keeps the counters of each side on their own cache line
+#define SHM_CACHE_LINE 64
+// how long a side sleeps before it looks whether the other one is gone
+#define SHM_POLL_NS 100000000
+// sleeps before turtle gives up on a reader that does not map the region,
+// when the ring is full or at the end
+#define SHM_MAP_POLLS 50
+
+// the layout described in turtle-output.h
+struct shm_header {
+  char magic[8];
+  uint32_t capacity;
+  uint32_t record_size;
+  char pad0[SHM_CACHE_LINE - 16];
+
+  // written by turtle, sequentially consistent like in turtle-pipeline.c
+  uint32_t head; // records published
+  uint32_t done; // no record will be published anymore
+  uint32_t reader_waiting;
+  char pad1[SHM_CACHE_LINE - 12];
+
+  // written by the viewer
+  uint32_t tail; // records read
+  uint32_t writer_waiting;
+  uint32_t mapped; // the viewer reads the ring
+  char pad2[SHM_CACHE_LINE - 12];
+};
+
+struct shm_record {
+  uint32_t kind;
+  uint32_t pad;
+  double values[3];
+};
+
+struct output_shm {
+  struct output base;
+  int pipe;       // the text stream, the reader is gone once it is closed
+  char name[64];
+  struct shm_header *header;
+  struct shm_record *ring;
+  size_t size;    // of the mapping
+  uint32_t mask;  // capacity - 1, the capacity is a power of 2
+  bool failed;    // the reader is gone, the records are dropped
+  bool mapped;    // the reader mapped the region, it unlinked it then
+
+  uint32_t written;   // records in the ring, some maybe not published yet
+  uint32_t published; // last value of head
+  uint32_t seen_tail; // last value of tail read
+};
+
+static uint32_t shm_load(const uint32_t *v) {
+  return __atomic_load_n(v, __ATOMIC_SEQ_CST);
+}
+
+static void shm_store(uint32_t *v, uint32_t value) {
+  __atomic_store_n(v, value, __ATOMIC_SEQ_CST);
+}
+
+// sleep while *word is value, false if it timed out
+static bool shm_sleep(uint32_t *word, uint32_t value) {
+  struct timespec timeout = {0, SHM_POLL_NS};
+  long ret = syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, NULL, 0);
+  return ret == 0 || errno != ETIMEDOUT;
+}
+
+static void shm_wake(uint32_t *word) {
+  syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static bool shm_reader_gone(const struct output_shm *self) {
+  struct pollfd fd = {.fd = self->pipe, .events = POLLOUT};
+  return poll(&fd, 1, 0) > 0 && (fd.revents & (POLLERR | POLLHUP));
+}
+
+static void shm_publish(struct output_shm *self) {
+  struct shm_header *header = self->header;
+  if (self->published != self->written) {
+    self->published = self->written;
+    shm_store(&header->head, self->written);
+    if (shm_load(&header->reader_waiting)) {
+      shm_wake(&header->head);
+    }
+  }
+}
+
+// wait a bounded time for the reader to map the region, the other end of
+// the pipe may not be turtle-viewer
+static bool shm_wait_mapped(struct output_shm *self) {
+  struct shm_header *header = self->header;
+  for (int i = 0; !self->mapped && i < SHM_MAP_POLLS; ++i) {
+    self->mapped = shm_load(&header->mapped) != 0;
+    if (!self->mapped) {
+      if (shm_reader_gone(self)) {
+        break;
+      }
+      shm_sleep(&header->mapped, 0);
+    }
+  }
+  if (!self->mapped) {
+    fprintf(stderr, "%s: no reader mapped the shared memory\n", self->name);
+  }
+  return self->mapped;
+}
+
+// wait for the reader to make room, false if it is gone
+static bool shm_wait_room(struct output_shm *self) {
+  struct shm_header *header = self->header;
+  bool gone = false;
+  shm_store(&header->writer_waiting, 1);
+  uint32_t tail;
+  while (!gone && self->written - (tail = shm_load(&header->tail)) >
+                      self->mask) {
+    gone = !shm_sleep(&header->tail, tail) && shm_reader_gone(self);
+  }
+  shm_store(&header->writer_waiting, 0);
+  self->seen_tail = tail;
+  return !gone;
+}
+
+static void output_shm_emit(struct output *base,
+                            const struct output_record *rec) {
+  struct output_shm *self = (struct output_shm *)base;
+  if (self->failed) {
+    return;
+  }
+  if (self->written - self->seen_tail > self->mask) {
+    self->seen_tail = shm_load(&self->header->tail);
+    if (self->written - self->seen_tail > self->mask) {
+      shm_publish(self);
+      if (!shm_wait_mapped(self)) {
+        self->failed = true;
+        return;
+      }
+      if (!shm_wait_room(self)) {
+        fprintf(stderr, "%s: the reader is gone\n", self->name);
+        self->failed = true;
+        return;
+      }
+    }
+  }
+
+  struct shm_record *slot = &self->ring[self->written & self->mask];
+  slot->kind = rec->kind;
+  if (rec->kind == OUTPUT_COLOR) {
+    slot->values[0] = rec->u.color.r;
+    slot->values[1] = rec->u.color.g;
+    slot->values[2] = rec->u.color.b;
+  } else {
+    slot->values[0] = rec->u.point.x;
+    slot->values[1] = rec->u.point.y;
+  }
+  self->base.bytes += sizeof(struct shm_record);
+  if (++self->written - self->published >= SHM_BATCH) {
+    shm_publish(self);
+  }
+}
+
+// the reader reads the last records after turtle exits, it is only waited
+// for until it maps the region
+static bool output_shm_finish(struct output *base) {
+  struct output_shm *self = (struct output_shm *)base;
+  if (self->failed) {
+    return false;
+  }
+  shm_publish(self);
+  shm_store(&self->header->done, 1);
+  shm_wake(&self->header->head);
+  if (!shm_wait_mapped(self)) {
+    self->failed = true;
+  } else if (shm_reader_gone(self) &&
+             shm_load(&self->header->tail) != self->written) {
+    fprintf(stderr, "%s: the reader is gone\n", self->name);
+    self->failed = true;
+  }
+  return !self->failed;
+}
+
+static void output_shm_destroy(struct output *base) {
+  struct output_shm *self = (struct output_shm *)base;
+  munmap(self->header, self->size);
+  // otherwise the reader unlinked it once it mapped it
+  if (!self->mapped) {
+    shm_unlink(self->name);
+  }
+  free(self);
+}
+
+struct output *output_shm_create(FILE *pipe) {
+  struct stat st;
+  if (fstat(fileno(pipe), &st) != 0 || !S_ISFIFO(st.st_mode)) {
+    return NULL;
+  }
+
+  struct output_shm *self = calloc(1, sizeof(struct output_shm));
+  self->base.emit = output_shm_emit;
+  self->base.finish = output_shm_finish;
+  self->base.destroy = output_shm_destroy;
+  self->pipe = fileno(pipe);
+  self->mask = OUTPUT_SHM_RECORDS - 1;
+  self->size = sizeof(struct shm_header) +
+               (size_t)OUTPUT_SHM_RECORDS * sizeof(struct shm_record);
+
+  // a name left by a process that had the same pid is stale
+  snprintf(self->name, sizeof(self->name), "/turtle-%ld", (long)getpid());
+  shm_unlink(self->name);
+  int fd = shm_open(self->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0) {
+    perror(self->name);
+    free(self);
+    return NULL;
+  }
+  void *map = MAP_FAILED;
+  if (ftruncate(fd, self->size) == 0) {
+    map = mmap(NULL, self->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  if (map == MAP_FAILED) {
+    perror(self->name);
+    close(fd);
+    shm_unlink(self->name);
+    free(self);
+    return NULL;
+  }
+  close(fd);
+
+  self->header = map;
+  self->ring = (struct shm_record *)(self->header + 1);
+  memcpy(self->header->magic, OUTPUT_SHM_MAGIC, 8);
+  self->header->capacity = OUTPUT_SHM_RECORDS;
+  self->header->record_size = sizeof(struct shm_record);
+
+  fprintf(pipe, OUTPUT_SHM_KEYWORD " %s\n", self->name);
+  fflush(pipe);
+  return &self->base;
+}
+
+#else
+
+struct output *output_shm_create(FILE *pipe) {
+  (void)pipe;
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,330 @@
+#include "turtle-output.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// coordinates are compared at the precision of the text output
+#define SIMPLIFY_QUANTUM 1e6
+// maximum sine of the angle between two segments considered collinear
+#define SIMPLIFY_COLLINEAR_EPSILON 1e-9
+
+struct simplify_point {
+  double x;
+  double y;
+  int64_t qx;
+  int64_t qy;
+};
+
+// a drawn segment, endpoints sorted so that both directions share a key
+struct simplify_key {
+  int64_t ax;
+  int64_t ay;
+  int64_t bx;
+  int64_t by;
+};
+
+struct output_simplify {
+  struct output base;
+  struct output_simplify_stats stats;
+
+  struct simplify_point cur; // position after every record received so far
+
+  bool has_line; // a line waiting for a collinear continuation
+  struct simplify_point line_from;
+  struct simplify_point line_to;
+
+  bool has_move; // a move waiting for the next line
+  struct simplify_point move;
+
+  bool has_color; // a color waiting for the next line
+  double color[3];
+  bool color_known; // whether color_out is valid
+  double color_out[3];
+
+  // segments drawn with the current color, open addressing
+  struct simplify_key *keys;
+  bool *used;
+  size_t size;
+  size_t count;
+};
+
+static struct simplify_point simplify_point_make(double x, double y) {
+  struct simplify_point p;
+  p.x = x;
+  p.y = y;
+  p.qx = llround(x * SIMPLIFY_QUANTUM);
+  p.qy = llround(y * SIMPLIFY_QUANTUM);
+  return p;
+}
+
+static bool simplify_point_eq(const struct simplify_point *a,
+                              const struct simplify_point *b) {
+  return a->qx == b->qx && a->qy == b->qy;
+}
+
+/*
+ * segment set
+ */
+
+static size_t simplify_key_hash(const struct simplify_key *k) {
+  uint64_t h = 14695981039346656037ULL;
+  const int64_t v[4] = {k->ax, k->ay, k->bx, k->by};
+  for (size_t i = 0; i < 4; ++i) {
+    h ^= (uint64_t)v[i];
+    h *= 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+static bool simplify_key_eq(const struct simplify_key *a,
+                            const struct simplify_key *b) {
+  return a->ax == b->ax && a->ay == b->ay && a->bx == b->bx && a->by == b->by;
+}
+
+static void simplify_set_clear(struct output_simplify *self) {
+  if (self->count > 0) {
+    memset(self->used, 0, self->size * sizeof(bool));
+    self->count = 0;
+  }
+}
+
+// insert the key, return false if it was already present
+static bool simplify_set_insert(struct output_simplify *self,
+                                const struct simplify_key *key) {
+  if (2 * (self->count + 1) > self->size) {
+    size_t old_size = self->size;
+    struct simplify_key *old_keys = self->keys;
+    bool *old_used = self->used;
+    self->size = old_size ? 2 * old_size : 64;
+    self->keys = calloc(self->size, sizeof(struct simplify_key));
+    self->used = calloc(self->size, sizeof(bool));
+    self->count = 0;
+    for (size_t i = 0; i < old_size; ++i) {
+      if (old_used[i]) {
+        simplify_set_insert(self, &old_keys[i]);
+      }
+    }
+    free(old_keys);
+    free(old_used);
+  }
+
+  size_t i = simplify_key_hash(key) & (self->size - 1);
+  while (self->used[i]) {
+    if (simplify_key_eq(&self->keys[i], key)) {
+      return false;
+    }
+    i = (i + 1) & (self->size - 1);
+  }
+  self->used[i] = true;
+  self->keys[i] = *key;
+  self->count++;
+  return true;
+}
+
+/*
+ * pending records
+ */
+
+static void simplify_forward(struct output_simplify *self,
+                             const struct output_record *rec) {
+  self->stats.records_out++;
+  output_emit(self->base.next, rec);
+}
+
+static void simplify_forward_point(struct output_simplify *self,
+                                   enum output_kind kind,
+                                   const struct simplify_point *p) {
+  struct output_record rec;
+  rec.kind = kind;
+  rec.u.point.x = p->x;
+  rec.u.point.y = p->y;
+  simplify_forward(self, &rec);
+}
+
+static void simplify_flush_line(struct output_simplify *self) {
+  if (self->has_line) {
+    simplify_forward_point(self, OUTPUT_LINE_TO, &self->line_to);
+    self->has_line = false;
+  }
+}
+
+static void simplify_flush_move(struct output_simplify *self) {
+  if (self->has_move) {
+    simplify_forward_point(self, OUTPUT_MOVE_TO, &self->move);
+    self->has_move = false;
+  }
+}
+
+static void simplify_flush_color(struct output_simplify *self) {
+  if (self->has_color) {
+    struct output_record rec;
+    rec.kind = OUTPUT_COLOR;
+    rec.u.color.r = self->color[0];
+    rec.u.color.g = self->color[1];
+    rec.u.color.b = self->color[2];
+    simplify_forward(self, &rec);
+    memcpy(self->color_out, self->color, sizeof(self->color));
+    self->color_known = true;
+    self->has_color = false;
+    // what was drawn before may be covered by the new color
+    simplify_set_clear(self);
+  }
+}
+
+/*
+ * records
+ */
+
+static void simplify_move_to(struct output_simplify *self,
+                             const struct simplify_point *p) {
+  if (simplify_point_eq(p, &self->cur)) {
+    self->stats.elided_moves++;
+    return;
+  }
+  simplify_flush_line(self);
+  if (self->has_move) {
+    self->stats.elided_moves++;
+  }
+  self->has_move = true;
+  self->move = *p;
+  self->cur = *p;
+}
+
+static bool simplify_collinear(const struct simplify_point *a,
+                               const struct simplify_point *b,
+                               const struct simplify_point *c) {
+  double ux = b->x - a->x;
+  double uy = b->y - a->y;
+  double vx = c->x - b->x;
+  double vy = c->y - b->y;
+  double cross = ux * vy - uy * vx;
+  double dot = ux * vx + uy * vy;
+  double eps = SIMPLIFY_COLLINEAR_EPSILON * hypot(ux, uy) * hypot(vx, vy);
+  return dot > 0 && fabs(cross) <= eps;
+}
+
+static void simplify_line_to(struct output_simplify *self,
+                             const struct simplify_point *p) {
+  if (simplify_point_eq(p, &self->cur)) {
+    // a line of length zero draws nothing
+    self->stats.elided_moves++;
+    return;
+  }
+
+  struct simplify_key key;
+  if (self->cur.qx < p->qx || (self->cur.qx == p->qx && self->cur.qy < p->qy)) {
+    key = (struct simplify_key){self->cur.qx, self->cur.qy, p->qx, p->qy};
+  } else {
+    key = (struct simplify_key){p->qx, p->qy, self->cur.qx, self->cur.qy};
+  }
+
+  // a pending color clears the set once flushed, nothing can be a duplicate
+  bool recolor = self->has_color;
+  if (!recolor && !simplify_set_insert(self, &key)) {
+    // already drawn with this color, only the pen position matters
+    self->stats.duplicate_segments++;
+    simplify_move_to(self, p);
+    return;
+  }
+
+  if (self->has_line &&
+      simplify_collinear(&self->line_from, &self->line_to, p)) {
+    self->stats.merged_segments++;
+    self->line_to = *p;
+    self->cur = *p;
+    return;
+  }
+
+  simplify_flush_line(self);
+  simplify_flush_color(self);
+  simplify_flush_move(self);
+  if (recolor) {
+    simplify_set_insert(self, &key);
+  }
+  self->has_line = true;
+  self->line_from = self->cur;
+  self->line_to = *p;
+  self->cur = *p;
+}
+
+static bool simplify_color_eq(const double color[3], double r, double g,
+                              double b) {
+  return color[0] == r && color[1] == g && color[2] == b;
+}
+
+static void simplify_color(struct output_simplify *self, double r, double g,
+                           double b) {
+  if (self->has_color) {
+    if (simplify_color_eq(self->color, r, g, b)) {
+      self->stats.elided_colors++;
+      return;
+    }
+    // nothing was drawn with the pending color
+    self->stats.elided_colors++;
+    self->has_color = false;
+  }
+  if (self->color_known && simplify_color_eq(self->color_out, r, g, b)) {
+    self->stats.elided_colors++;
+    return;
+  }
+  simplify_flush_line(self);
+  self->has_color = true;
+  self->color[0] = r;
+  self->color[1] = g;
+  self->color[2] = b;
+}
+
+static void output_simplify_emit(struct output *base,
+                                 const struct output_record *rec) {
+  struct output_simplify *self = (struct output_simplify *)base;
+  self->stats.records_in++;
+  switch (rec->kind) {
+  case OUTPUT_MOVE_TO: {
+    struct simplify_point p = simplify_point_make(rec->u.point.x, rec->u.point.y);
+    simplify_move_to(self, &p);
+    break;
+  }
+  case OUTPUT_LINE_TO: {
+    struct simplify_point p = simplify_point_make(rec->u.point.x, rec->u.point.y);
+    simplify_line_to(self, &p);
+    break;
+  }
+  case OUTPUT_COLOR:
+    simplify_color(self, rec->u.color.r, rec->u.color.g, rec->u.color.b);
+    break;
+  }
+}
+
+static bool output_simplify_finish(struct output *base) {
+  struct output_simplify *self = (struct output_simplify *)base;
+  simplify_flush_line(self);
+  simplify_flush_color(self);
+  simplify_flush_move(self);
+  return true;
+}
+
+static void output_simplify_destroy(struct output *base) {
+  struct output_simplify *self = (struct output_simplify *)base;
+  free(self->keys);
+  free(self->used);
+  free(self);
+}
+
+struct output *output_simplify_create(struct output *next) {
+  struct output_simplify *self = calloc(1, sizeof(struct output_simplify));
+  self->base.emit = output_simplify_emit;
+  self->base.finish = output_simplify_finish;
+  self->base.destroy = output_simplify_destroy;
+  self->base.next = next;
+  self->cur = simplify_point_make(0, 0);
+  return &self->base;
+}
+
+const struct output_simplify_stats *
+output_simplify_stats(const struct output *self) {
+  return &((const struct output_simplify *)self)->stats;
+}
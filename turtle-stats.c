@@ -0,0 +1,245 @@
+#include "turtle-output.h"
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// what the records of a span drew
+struct stats_span {
+  size_t segments;
+  double length;
+  bool has_extent;
+  double min_x;
+  double min_y;
+  double max_x;
+  double max_y;
+  double color[3]; // current color when the span began
+};
+
+struct stats_color {
+  double rgb[3];
+};
+
+struct output_stats_stage {
+  struct output base;
+  struct output_stats stats;
+
+  double x; // position after the last record
+  double y;
+  double color[3];
+  bool color_counted; // whether the current color is in the set
+
+  // the spans being accumulated, the first one is the whole drawing
+  struct stats_span *spans;
+  size_t spans_count;
+  size_t spans_capacity;
+
+  // distinct colors of the segments, open addressing
+  struct stats_color *colors;
+  bool *used;
+  size_t size;
+};
+
+/*
+ * color set
+ */
+
+static size_t stats_color_hash(const double rgb[3]) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < 3; ++i) {
+    uint64_t v;
+    memcpy(&v, &rgb[i], sizeof(v));
+    h ^= v;
+    h *= 1099511628211ULL;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+static void stats_color_insert(struct output_stats_stage *self,
+                               const double rgb[3]) {
+  if (2 * (self->stats.colors + 1) > self->size) {
+    size_t old_size = self->size;
+    struct stats_color *old_colors = self->colors;
+    bool *old_used = self->used;
+    self->size = old_size ? 2 * old_size : 16;
+    self->colors = calloc(self->size, sizeof(struct stats_color));
+    self->used = calloc(self->size, sizeof(bool));
+    self->stats.colors = 0;
+    for (size_t i = 0; i < old_size; ++i) {
+      if (old_used[i]) {
+        stats_color_insert(self, old_colors[i].rgb);
+      }
+    }
+    free(old_colors);
+    free(old_used);
+  }
+
+  size_t i = stats_color_hash(rgb) & (self->size - 1);
+  while (self->used[i]) {
+    if (memcmp(self->colors[i].rgb, rgb, sizeof(self->colors[i].rgb)) == 0) {
+      return;
+    }
+    i = (i + 1) & (self->size - 1);
+  }
+  self->used[i] = true;
+  memcpy(self->colors[i].rgb, rgb, sizeof(self->colors[i].rgb));
+  self->stats.colors++;
+}
+
+/*
+ * spans
+ */
+
+static void stats_extend(struct stats_span *span, double x, double y) {
+  if (!span->has_extent) {
+    span->min_x = span->max_x = x;
+    span->min_y = span->max_y = y;
+    span->has_extent = true;
+    return;
+  }
+  span->min_x = fmin(span->min_x, x);
+  span->min_y = fmin(span->min_y, y);
+  span->max_x = fmax(span->max_x, x);
+  span->max_y = fmax(span->max_y, y);
+}
+
+// extend with the extent of the span moved by (dx, dy)
+static void stats_cover(struct stats_span *into, const struct stats_span *span,
+                        double dx, double dy) {
+  if (span->has_extent) {
+    stats_extend(into, span->min_x + dx, span->min_y + dy);
+    stats_extend(into, span->max_x + dx, span->max_y + dy);
+  }
+}
+
+static void output_stats_emit(struct output *base,
+                              const struct output_record *rec) {
+  struct output_stats_stage *self = (struct output_stats_stage *)base;
+  switch (rec->kind) {
+  case OUTPUT_MOVE_TO:
+    self->x = rec->u.point.x;
+    self->y = rec->u.point.y;
+    break;
+
+  case OUTPUT_LINE_TO: {
+    struct stats_span *span = &self->spans[self->spans_count - 1];
+    span->segments++;
+    span->length += hypot(rec->u.point.x - self->x, rec->u.point.y - self->y);
+    stats_extend(span, self->x, self->y);
+    stats_extend(span, rec->u.point.x, rec->u.point.y);
+    self->x = rec->u.point.x;
+    self->y = rec->u.point.y;
+    if (!self->color_counted) {
+      stats_color_insert(self, self->color);
+      self->color_counted = true;
+    }
+    break;
+  }
+
+  case OUTPUT_COLOR:
+    self->color[0] = rec->u.color.r;
+    self->color[1] = rec->u.color.g;
+    self->color[2] = rec->u.color.b;
+    self->color_counted = false;
+    break;
+  }
+}
+
+static bool output_stats_finish(struct output *base) {
+  struct output_stats_stage *self = (struct output_stats_stage *)base;
+  const struct stats_span *all = &self->spans[0];
+  self->stats.segments = all->segments;
+  self->stats.length = all->length;
+  self->stats.has_extent = all->has_extent;
+  self->stats.min_x = all->min_x;
+  self->stats.min_y = all->min_y;
+  self->stats.max_x = all->max_x;
+  self->stats.max_y = all->max_y;
+  return true;
+}
+
+static void output_stats_destroy(struct output *base) {
+  struct output_stats_stage *self = (struct output_stats_stage *)base;
+  free(self->spans);
+  free(self->colors);
+  free(self->used);
+  free(self);
+}
+
+struct output *output_stats_create(void) {
+  struct output_stats_stage *self =
+      calloc(1, sizeof(struct output_stats_stage));
+  self->base.emit = output_stats_emit;
+  self->base.finish = output_stats_finish;
+  self->base.destroy = output_stats_destroy;
+  self->base.next = NULL;
+  self->spans_capacity = 16;
+  self->spans = calloc(self->spans_capacity, sizeof(struct stats_span));
+  self->spans_count = 1;
+  return &self->base;
+}
+
+const struct output_stats *output_stats_result(const struct output *self) {
+  return &((const struct output_stats_stage *)self)->stats;
+}
+
+void output_stats_span_begin(struct output *base) {
+  struct output_stats_stage *self = (struct output_stats_stage *)base;
+  if (self->spans_count == self->spans_capacity) {
+    self->spans_capacity *= 2;
+    self->spans = realloc(self->spans,
+                          self->spans_capacity * sizeof(struct stats_span));
+  }
+  struct stats_span *span = &self->spans[self->spans_count++];
+  memset(span, 0, sizeof(struct stats_span));
+  memcpy(span->color, self->color, sizeof(span->color));
+}
+
+bool output_stats_span_end(struct output *base, size_t count, double dx,
+                           double dy) {
+  struct output_stats_stage *self = (struct output_stats_stage *)base;
+  struct stats_span *span = &self->spans[--self->spans_count];
+  struct stats_span *parent = span - 1;
+  bool repeatable = memcmp(span->color, self->color, sizeof(span->color)) == 0;
+  if (!repeatable) {
+    count = 1;
+  }
+
+  parent->segments += span->segments * count;
+  parent->length += span->length * count;
+  // the copies in between are inside the extent of the first and the last
+  stats_cover(parent, span, 0, 0);
+  stats_cover(parent, span, (count - 1) * dx, (count - 1) * dy);
+  self->x += (count - 1) * dx;
+  self->y += (count - 1) * dy;
+  return repeatable;
+}
+
+// JSON has no infinities nor NaN
+static void stats_number(FILE *file, const char *name, double v,
+                         const char *sep) {
+  if (isfinite(v)) {
+    fprintf(file, "\"%s\": %.6f%s", name, v, sep);
+  } else {
+    fprintf(file, "\"%s\": null%s", name, sep);
+  }
+}
+
+void output_stats_write(const struct output *self, FILE *file) {
+  const struct output_stats *stats = output_stats_result(self);
+  fprintf(file, "{\n  \"segments\": %zu,\n  ", stats->segments);
+  stats_number(file, "length", stats->length, ",\n");
+  fprintf(file, "  \"colors\": %zu,\n  \"extent\": ", stats->colors);
+  if (stats->has_extent) {
+    fputc('{', file);
+    stats_number(file, "min_x", stats->min_x, ", ");
+    stats_number(file, "min_y", stats->min_y, ", ");
+    stats_number(file, "max_x", stats->max_x, ", ");
+    stats_number(file, "max_y", stats->max_y, "}\n}\n");
+  } else {
+    fputs("null\n}\n", file);
+  }
+}
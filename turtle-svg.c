@@ -0,0 +1,281 @@
+#include "turtle-output.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// maximum number of commands in one path element
+#define SVG_PATH_MAX 10000
+// room kept in the header for the viewBox, patched once the extent is known
+#define SVG_VIEWBOX_WIDTH 96
+
+struct output_svg {
+  struct output base;
+  FILE *file;
+  bool close_file;
+  FILE *target; // the pipe copied from file once the viewBox is patched
+  bool close_target;
+  double line_width;
+
+  int precision; // digits after the decimal point
+  double scale;  // 10^precision
+
+  int64_t x; // current position, quantized
+  int64_t y;
+  int64_t pen_x; // last position written in the current path, quantized
+  int64_t pen_y;
+  bool in_path;
+  size_t path_commands;
+  char last_command;
+  char color[8]; // #rrggbb
+
+  long viewbox_offset;
+  bool has_extent;
+  int64_t min_x;
+  int64_t min_y;
+  int64_t max_x;
+  int64_t max_y;
+};
+
+// the writes of the image, counted as they go for a budget on the bytes
+static void svg_putc(struct output_svg *self, char c) {
+  fputc(c, self->file);
+  self->base.bytes++;
+}
+
+static void svg_puts(struct output_svg *self, const char *s) {
+  fputs(s, self->file);
+  self->base.bytes += strlen(s);
+}
+
+static void svg_printf(struct output_svg *self, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vfprintf(self->file, format, args);
+  va_end(args);
+  if (n > 0) {
+    self->base.bytes += n;
+  }
+}
+
+// write a quantized coordinate with as few characters as possible, the
+// sign doubles as a separator
+static void svg_number(struct output_svg *self, int64_t q, bool separator) {
+  if (q < 0) {
+    svg_putc(self, '-');
+    q = -q;
+  } else if (separator) {
+    svg_putc(self, ' ');
+  }
+  int64_t unit = 1;
+  for (int i = 0; i < self->precision; ++i) {
+    unit *= 10;
+  }
+  int64_t frac = q % unit;
+  svg_printf(self, "%" PRId64, q / unit);
+  if (frac != 0) {
+    int digits = self->precision;
+    while (frac % 10 == 0) {
+      frac /= 10;
+      --digits;
+    }
+    svg_printf(self, ".%0*" PRId64, digits, frac);
+  }
+}
+
+static void svg_extend(struct output_svg *self, int64_t x, int64_t y) {
+  if (!self->has_extent) {
+    self->min_x = self->max_x = x;
+    self->min_y = self->max_y = y;
+    self->has_extent = true;
+    return;
+  }
+  self->min_x = x < self->min_x ? x : self->min_x;
+  self->min_y = y < self->min_y ? y : self->min_y;
+  self->max_x = x > self->max_x ? x : self->max_x;
+  self->max_y = y > self->max_y ? y : self->max_y;
+}
+
+static void svg_close_path(struct output_svg *self) {
+  if (self->in_path) {
+    svg_puts(self, "\"/>\n");
+    self->in_path = false;
+  }
+}
+
+// append a relative command from the pen to the current position
+static void svg_relative(struct output_svg *self, char command) {
+  if (command != self->last_command) {
+    svg_putc(self, command);
+    svg_number(self, self->x - self->pen_x, false);
+  } else {
+    svg_number(self, self->x - self->pen_x, true);
+  }
+  svg_number(self, self->y - self->pen_y, true);
+  self->pen_x = self->x;
+  self->pen_y = self->y;
+  self->last_command = command;
+  self->path_commands++;
+}
+
+static void output_svg_emit(struct output *base,
+                            const struct output_record *rec) {
+  struct output_svg *self = (struct output_svg *)base;
+  switch (rec->kind) {
+  case OUTPUT_MOVE_TO:
+    self->x = llround(rec->u.point.x * self->scale);
+    self->y = llround(rec->u.point.y * self->scale);
+    break;
+
+  case OUTPUT_LINE_TO: {
+    if (self->in_path && self->path_commands >= SVG_PATH_MAX) {
+      svg_close_path(self);
+    }
+    if (!self->in_path) {
+      svg_printf(self, "<path stroke=\"%s\" d=\"M", self->color);
+      svg_number(self, self->x, false);
+      svg_number(self, self->y, true);
+      self->pen_x = self->x;
+      self->pen_y = self->y;
+      self->in_path = true;
+      self->path_commands = 0;
+      self->last_command = 'M';
+    } else if (self->pen_x != self->x || self->pen_y != self->y) {
+      // a move in the middle of a run of the same color
+      svg_relative(self, 'm');
+    }
+    svg_extend(self, self->x, self->y);
+    self->x = llround(rec->u.point.x * self->scale);
+    self->y = llround(rec->u.point.y * self->scale);
+    svg_relative(self, 'l');
+    svg_extend(self, self->x, self->y);
+    break;
+  }
+
+  case OUTPUT_COLOR: {
+    char color[8];
+    snprintf(color, sizeof(color), "#%02x%02x%02x",
+             (unsigned)lround(fmin(fmax(rec->u.color.r, 0), 1) * 255),
+             (unsigned)lround(fmin(fmax(rec->u.color.g, 0), 1) * 255),
+             (unsigned)lround(fmin(fmax(rec->u.color.b, 0), 1) * 255));
+    if (strcmp(color, self->color) != 0) {
+      svg_close_path(self);
+      memcpy(self->color, color, sizeof(color));
+    }
+    break;
+  }
+  }
+}
+
+static bool output_svg_finish(struct output *base) {
+  struct output_svg *self = (struct output_svg *)base;
+  svg_close_path(self);
+  svg_puts(self, "</g>\n</svg>\n");
+
+  if (self->has_extent) {
+    double margin = self->line_width;
+    double x = self->min_x / self->scale - margin;
+    double y = self->min_y / self->scale - margin;
+    double w = (self->max_x - self->min_x) / self->scale + 2 * margin;
+    double h = (self->max_y - self->min_y) / self->scale + 2 * margin;
+    char viewbox[SVG_VIEWBOX_WIDTH + 1];
+    int p = self->precision;
+    int len = snprintf(viewbox, sizeof(viewbox),
+                       "viewBox=\"%.*f %.*f %.*f %.*f\"", p, x, p, y, p, w, p, h);
+    if (len <= SVG_VIEWBOX_WIDTH &&
+        fseek(self->file, self->viewbox_offset, SEEK_SET) == 0) {
+      fputs(viewbox, self->file); // over the blanks already counted
+    }
+  }
+
+  bool ok = !ferror(self->file);
+  if (self->target) {
+    char buffer[65536];
+    size_t n;
+    rewind(self->file);
+    while ((n = fread(buffer, 1, sizeof(buffer), self->file)) > 0) {
+      ok = fwrite(buffer, 1, n, self->target) == n && ok;
+    }
+    ok = !ferror(self->file) && fflush(self->target) == 0 && ok;
+    if (self->close_target) {
+      ok = fclose(self->target) == 0 && ok;
+      self->target = NULL;
+    }
+  }
+  if (self->close_file) {
+    ok = fclose(self->file) == 0 && ok;
+    self->file = NULL;
+  } else {
+    ok = fflush(self->file) == 0 && ok;
+  }
+  return ok;
+}
+
+static void output_svg_destroy(struct output *base) {
+  struct output_svg *self = (struct output_svg *)base;
+  if (self->close_file && self->file) {
+    fclose(self->file);
+  }
+  if (self->close_target && self->target) {
+    fclose(self->target);
+  }
+  free(self);
+}
+
+struct output *output_svg_create(const struct output_svg_options *opts) {
+  FILE *file = stdout;
+  bool close_file = false;
+  if (strcmp(opts->path, "-") != 0) {
+    file = fopen(opts->path, "w");
+    if (!file) {
+      perror(opts->path);
+      return NULL;
+    }
+    close_file = true;
+  }
+  // the viewBox is only known at the end, a pipe gets a temporary copy
+  FILE *target = NULL;
+  bool close_target = false;
+  if (fseek(file, 0, SEEK_CUR) != 0) {
+    target = file;
+    close_target = close_file;
+    file = tmpfile();
+    if (!file) {
+      perror("tmpfile");
+      if (close_target) {
+        fclose(target);
+      }
+      return NULL;
+    }
+    close_file = true;
+  }
+
+  struct output_svg *self = calloc(1, sizeof(struct output_svg));
+  self->base.emit = output_svg_emit;
+  self->base.finish = output_svg_finish;
+  self->base.destroy = output_svg_destroy;
+  self->base.next = NULL;
+  self->file = file;
+  self->close_file = close_file;
+  self->target = target;
+  self->close_target = close_target;
+  self->line_width = opts->line_width;
+  self->precision = opts->precision;
+  self->scale = pow(10, opts->precision);
+  strcpy(self->color, "#000000");
+
+  svg_puts(self, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<svg "
+                 "xmlns=\"http://www.w3.org/2000/svg\" ");
+  self->viewbox_offset = ftell(file);
+  svg_printf(self, "%*s>\n", SVG_VIEWBOX_WIDTH, "");
+  svg_printf(self,
+             "<g fill=\"none\" stroke-width=\"%g\" stroke-linecap=\"round\" "
+             "stroke-linejoin=\"round\">\n",
+             opts->line_width);
+  return &self->base;
+}
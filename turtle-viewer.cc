@@ -1,8 +1,30 @@
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #include <gf/Action.h>
 #include <gf/Clock.h>
@@ -10,10 +32,14 @@
 #include <gf/Curves.h>
 #include <gf/EntityContainer.h>
 #include <gf/Event.h>
+#include <gf/RenderTexture.h>
 #include <gf/RenderWindow.h>
 #include <gf/Shapes.h>
+#include <gf/Sprite.h>
 #include <gf/Vector.h>
 #include <gf/VectorOps.h>
+#include <gf/Vertex.h>
+#include <gf/VertexArray.h>
 #include <gf/ViewContainer.h>
 #include <gf/Views.h>
 #include <gf/Window.h>
@@ -28,53 +54,1212 @@ static constexpr const char *ColorKw = "Color";
 static constexpr const char *MoveToKw = "MoveTo";
 static constexpr const char *LineToKw = "LineTo";
 
-int main() {
-  std::vector<Command> commands;
-  std::vector<gf::Vector2f> points;
-  std::vector<gf::Color4f> colors;
+/*
+ * compact storage of the records
+ */
+
+// bytes allocated in chunks of growing size, so that a growing store never
+// copies what it already holds
+class ByteChunks {
+public:
+  static constexpr std::size_t MinChunkSize = 1 << 12;
+  static constexpr std::size_t MaxChunkSize = 1 << 20;
+
+  struct Position {
+    std::size_t chunk = 0;
+    std::size_t offset = 0;
+  };
+
+  // make sure the next size bytes are in the same chunk
+  void reserve(std::size_t size) {
+    if (m_chunks.empty() || m_used.back() + size > m_sizes.back()) {
+      std::size_t chunkSize = m_sizes.empty() ? MinChunkSize : std::min(2 * m_sizes.back(), MaxChunkSize);
+      m_chunks.emplace_back(new uint8_t[chunkSize]);
+      m_sizes.push_back(chunkSize);
+      m_used.push_back(0);
+    }
+  }
+
+  void put(uint8_t byte) {
+    reserve(1);
+    m_chunks.back()[m_used.back()++] = byte;
+  }
+
+  // a varint never spans two chunks
+  void putVarint(uint64_t value) {
+    reserve(10);
+    uint8_t *bytes = m_chunks.back().get();
+    std::size_t& used = m_used.back();
+    while (value >= 0x80) {
+      bytes[used++] = static_cast<uint8_t>(value) | 0x80;
+      value >>= 7;
+    }
+    bytes[used++] = static_cast<uint8_t>(value);
+  }
+
+  uint8_t get(Position& pos) const {
+    skipFullChunk(pos);
+    return m_chunks[pos.chunk][pos.offset++];
+  }
+
+  uint64_t getVarint(Position& pos) const {
+    skipFullChunk(pos);
+    const uint8_t *bytes = m_chunks[pos.chunk].get();
+    uint64_t value = 0;
+    for (unsigned shift = 0;; shift += 7) {
+      uint8_t byte = bytes[pos.offset++];
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+  }
+
+  Position getEnd() const {
+    return m_chunks.empty() ? Position() : Position{ m_chunks.size() - 1, m_used.back() };
+  }
+
+  std::size_t getMemoryUsage() const {
+    std::size_t usage = 0;
+    for (std::size_t size : m_sizes) {
+      usage += size;
+    }
+    return usage;
+  }
+
+private:
+  void skipFullChunk(Position& pos) const {
+    if (pos.offset == m_used[pos.chunk]) {
+      ++pos.chunk;
+      pos.offset = 0;
+    }
+  }
+
+private:
+  std::vector<std::unique_ptr<uint8_t[]>> m_chunks;
+  std::vector<std::size_t> m_sizes;
+  std::vector<std::size_t> m_used;
+};
+
+static uint64_t zigzag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// a delta read from a file, which may be corrupt, does not overflow
+static int64_t addDelta(int64_t value, int64_t delta) {
+  return static_cast<int64_t>(static_cast<uint64_t>(value) + static_cast<uint64_t>(delta));
+}
+
+struct Record {
+  Command command;
+  gf::Vector2f point;
+  gf::Color4f color;
+};
+
+// commands packed two bits each, points as deltas of fixed-point
+// coordinates with an absolute keyframe every KeyframeInterval points,
+// colors as indices in a palette
+class RecordStore {
+public:
+  static constexpr double PointScale = 256.0;  // fixed-point steps per unit
+  static constexpr std::size_t KeyframeInterval = 4096;
+
+  // where the decoding can start without the previous records
+  struct Keyframe {
+    std::size_t command; // index of the command of the point
+    ByteChunks::Position commands;
+    ByteChunks::Position points;
+    ByteChunks::Position colors;
+    uint32_t color; // palette index of the current color, or NoColor
+  };
+
+  static constexpr uint32_t NoColor = UINT32_MAX;
+
+  void addColor(const gf::Color4f& color) {
+    uint64_t key = 0;
+    for (float channel : { color.r, color.g, color.b }) {
+      key = key << 16 | static_cast<uint64_t>(std::lround(gf::clamp(channel, 0.0f, 1.0f) * 65535.0f));
+    }
+    auto it = m_paletteIndex.find(key);
+    if (it == m_paletteIndex.end()) {
+      it = m_paletteIndex.emplace(key, static_cast<uint32_t>(m_palette.size())).first;
+      m_palette.push_back(color);
+    }
+    m_colors.putVarint(it->second);
+    m_currentColor = it->second;
+    addCommand(Command::Color);
+    ++m_colorCount;
+  }
+
+  void addPoint(Command command, gf::Vector2f point) {
+    int64_t x = std::llround(point.x * PointScale);
+    int64_t y = std::llround(point.y * PointScale);
+
+    if (m_pointCount % KeyframeInterval == 0) {
+      m_keyframes.push_back({ m_commandCount, m_commands.getEnd(), m_points.getEnd(), m_colors.getEnd(), m_currentColor });
+      m_points.putVarint(zigzag(x));
+      m_points.putVarint(zigzag(y));
+    } else {
+      m_points.putVarint(zigzag(x - m_lastX));
+      m_points.putVarint(zigzag(y - m_lastY));
+    }
+    m_lastX = x;
+    m_lastY = y;
+
+    addCommand(command);
+    ++m_pointCount;
+  }
+
+  std::size_t getCommandCount() const {
+    return m_commandCount;
+  }
+
+  std::size_t getPointCount() const {
+    return m_pointCount;
+  }
+
+  std::size_t getKeyframeCount() const {
+    return m_keyframes.size();
+  }
+
+  std::size_t getMemoryUsage() const {
+    return m_commands.getMemoryUsage() + m_points.getMemoryUsage() + m_colors.getMemoryUsage()
+        + m_palette.capacity() * sizeof(gf::Color4f)
+        + m_keyframes.capacity() * sizeof(Keyframe);
+  }
+
+  // what a vector per kind of data takes for the same records
+  std::size_t getVectorUsage() const {
+    return m_commandCount * sizeof(Command) + m_pointCount * sizeof(gf::Vector2f) + m_colorCount * sizeof(gf::Color4f);
+  }
+
+  // decode the records in order, including the ones added after the cursor
+  class Cursor {
+  public:
+    explicit Cursor(const RecordStore& store)
+    : m_store(&store)
+    {
+    }
+
+    // start at a keyframe, the current color is the one of the keyframe
+    Cursor(const RecordStore& store, std::size_t keyframe)
+    : m_store(&store)
+    {
+      const Keyframe& frame = store.m_keyframes[keyframe];
+      m_command = frame.command;
+      m_commandPos = frame.commands;
+      if (m_command % 4 != 0) {
+        m_commandByte = m_store->getCommandByte(m_command, m_commandPos, m_commandPending);
+      }
+      m_point = keyframe * KeyframeInterval;
+      m_pointPos = frame.points;
+      m_colorPos = frame.colors;
+      m_color = frame.color;
+    }
+
+    // the color of the last color record, black before the first one
+    gf::Color4f getColor() const {
+      return m_color == NoColor ? gf::Color4f(gf::Color::Black) : m_store->m_palette[m_color];
+    }
+
+    bool next(Record& record) {
+      if (m_command == m_store->m_commandCount) {
+        return false;
+      }
+
+      if (m_command % 4 == 0 || m_commandPending) {
+        m_commandByte = m_store->getCommandByte(m_command, m_commandPos, m_commandPending);
+      }
+      record.command = static_cast<Command>((m_commandByte >> (m_command % 4) * 2) & 0x3);
+      ++m_command;
+
+      switch (record.command) {
+        case Command::Color:
+          m_color = static_cast<uint32_t>(m_store->m_colors.getVarint(m_colorPos));
+          record.color = m_store->m_palette[m_color];
+          break;
+        case Command::MoveTo:
+        case Command::LineTo: {
+          int64_t dx = unzigzag(m_store->m_points.getVarint(m_pointPos));
+          int64_t dy = unzigzag(m_store->m_points.getVarint(m_pointPos));
+          if (m_point % KeyframeInterval == 0) {
+            m_x = dx;
+            m_y = dy;
+          } else {
+            m_x += dx;
+            m_y += dy;
+          }
+          ++m_point;
+          record.point.x = static_cast<float>(m_x / PointScale);
+          record.point.y = static_cast<float>(m_y / PointScale);
+          break;
+        }
+      }
+
+      return true;
+    }
+
+  private:
+    const RecordStore *m_store;
+    std::size_t m_command = 0;
+    ByteChunks::Position m_commandPos;
+    uint8_t m_commandByte = 0;
+    bool m_commandPending = false; // records may have been added to its byte since
+    std::size_t m_point = 0;
+    ByteChunks::Position m_pointPos;
+    ByteChunks::Position m_colorPos;
+    uint32_t m_color = NoColor;
+    int64_t m_x = 0;
+    int64_t m_y = 0;
+  };
+
+private:
+  void addCommand(Command command) {
+    std::size_t shift = (m_commandCount % 4) * 2;
+    m_pending |= static_cast<uint8_t>(command) << shift;
+    ++m_commandCount;
+    if (m_commandCount % 4 == 0) {
+      m_commands.put(m_pending);
+      m_pending = 0;
+    }
+  }
+
+  // the byte of the command at index, read from pos unless it is pending
+  uint8_t getCommandByte(std::size_t index, ByteChunks::Position& pos, bool& pending) const {
+    pending = index / 4 == m_commandCount / 4;
+    return pending ? m_pending : m_commands.get(pos);
+  }
+
+private:
+  ByteChunks m_commands;
+  uint8_t m_pending = 0; // the last commands, until their byte is full
+  std::size_t m_commandCount = 0;
+
+  ByteChunks m_points;
+  std::size_t m_pointCount = 0;
+  int64_t m_lastX = 0;
+  int64_t m_lastY = 0;
+  std::vector<Keyframe> m_keyframes;
+
+  ByteChunks m_colors;
+  std::size_t m_colorCount = 0;
+  std::vector<gf::Color4f> m_palette;
+  std::unordered_map<uint64_t, uint32_t> m_paletteIndex;
+  uint32_t m_currentColor = NoColor;
+};
+
+/*
+ * parsing
+ */
+
+static constexpr std::size_t ParseChunkSize = 1 << 20;
+// smaller inputs are not split, so that each thread gets whole lines
+static constexpr std::size_t ParseMinChunkSize = 1 << 16;
+
+static bool isDigit(char c) {
+  return c >= '0' && c <= '9';
+}
+
+// parse a number written by printf: a decimal with at most 15 significant
+// digits is one correctly rounded division, like from_chars, anything else
+// goes to strtod, the input has to end with a non-numeric character
+static const char *parseNumber(const char *p, const char *end, double& value) {
+  static constexpr double Powers[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+  };
+
+  while (p < end && (*p == ' ' || *p == '\t')) {
+    ++p;
+  }
+
+  const char *start = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    ++p;
+  }
+
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int fraction = 0;
+  for (; p < end && isDigit(*p); ++p, ++digits) {
+    mantissa = mantissa * 10 + (*p - '0');
+  }
+  if (p < end && *p == '.') {
+    for (++p; p < end && isDigit(*p); ++p, ++digits, ++fraction) {
+      mantissa = mantissa * 10 + (*p - '0');
+    }
+  }
+
+  bool fast = digits > 0 && digits <= 15 && fraction <= 22
+      && (p == end || (*p != 'e' && *p != 'E'));
 
-  std::size_t movements = 0;
+  if (!fast) {
+    char *endptr;
+    value = std::strtod(start, &endptr);
+    return endptr;
+  }
 
-  for (std::string line; std::getline(std::cin, line); ) {
-    if (line.find(ColorKw) != std::string::npos) {
-      gf::Color4f color;
+  value = static_cast<double>(mantissa) / Powers[fraction];
+  if (negative) {
+    value = -value;
+  }
+  return p;
+}
 
-      char *endptr = &line[0] + std::strlen(ColorKw);
-      color.r = std::strtod(endptr, &endptr);
-      color.g = std::strtod(endptr, &endptr);
-      color.b = std::strtod(endptr, &endptr);
-      color.a = 1.0f;
+static bool startsWith(const char *p, const char *end, const char *keyword) {
+  std::size_t length = std::strlen(keyword);
+  return static_cast<std::size_t>(end - p) >= length && std::memcmp(p, keyword, length) == 0;
+}
 
-      commands.push_back(Command::Color);
-      colors.push_back(color);
+// parse whole lines, dispatching on their first byte
+static void parseLines(const char *p, const char *end, std::vector<Record>& records) {
+  while (p < end) {
+    const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      eol = end;
     }
 
-    if (line.find(MoveToKw) != std::string::npos) {
-      gf::Vector2f point;
+    Record record;
+    double x, y, z;
+
+    switch (*p) {
+      case 'C':
+        if (startsWith(p, eol, ColorKw)) {
+          const char *q = parseNumber(p + std::strlen(ColorKw), eol, x);
+          q = parseNumber(q, eol, y);
+          parseNumber(q, eol, z);
+          record.command = Command::Color;
+          record.color = gf::Color4f(x, y, z, 1.0f);
+          records.push_back(record);
+        }
+        break;
+      case 'M':
+      case 'L': {
+        bool move = *p == 'M';
+        const char *keyword = move ? MoveToKw : LineToKw;
+        if (startsWith(p, eol, keyword)) {
+          const char *q = parseNumber(p + std::strlen(keyword), eol, x);
+          parseNumber(q, eol, y);
+          record.command = move ? Command::MoveTo : Command::LineTo;
+          record.point = gf::Vector2f(x, y);
+          records.push_back(record);
+        }
+        break;
+      }
+      default:
+        break;
+    }
 
-      char *endptr = &line[0] + std::strlen(MoveToKw);
-      point.x = std::strtod(endptr, &endptr);
-      point.y = std::strtod(endptr, &endptr);
+    p = eol + 1;
+  }
+}
 
-      commands.push_back(Command::MoveTo);
-      points.push_back(point);
+static void storeRecords(RecordStore& store, const std::vector<Record>& records) {
+  for (auto& record : records) {
+    if (record.command == Command::Color) {
+      store.addColor(record.color);
+    } else {
+      store.addPoint(record.command, record.point);
+    }
+  }
+}
+
+// read the records, each block of complete lines is cut in newline-aligned
+// chunks that are parsed on the threads, then appended to the store in order
+static void loadRecords(std::FILE *input, RecordStore& store, std::size_t threads) {
+  std::vector<char> buffer(threads * ParseChunkSize + 1);
+  std::size_t capacity = buffer.size() - 1; // room for a terminating 0
+  std::size_t size = 0;
+  std::vector<std::vector<Record>> parsed(threads);
+  std::vector<std::thread> workers;
+
+  for (bool eof = false; !eof; ) {
+    size += std::fread(buffer.data() + size, 1, capacity - size, input);
+    eof = size < capacity;
+    buffer[size] = '\0';
+
+    // the last line may be incomplete until the end of the input
+    std::size_t complete = size;
+    if (!eof) {
+      const char *data = buffer.data();
+      while (complete > 0 && data[complete - 1] != '\n') {
+        --complete;
+      }
+      if (complete == 0) {
+        complete = size; // a line longer than the buffer
+      }
+    }
 
-      ++movements;
+    const char *data = buffer.data();
+    std::size_t parts = std::max<std::size_t>(1, std::min(threads, complete / ParseMinChunkSize));
+    std::size_t begin = 0;
+    for (std::size_t k = 0; k < parts; ++k) {
+      std::size_t end = std::max(complete * (k + 1) / parts, begin);
+      while (end > 0 && end < complete && data[end - 1] != '\n') {
+        ++end;
+      }
+      parsed[k].clear();
+      if (k + 1 < parts) {
+        workers.emplace_back(parseLines, data + begin, data + end, std::ref(parsed[k]));
+      } else {
+        parseLines(data + begin, data + end, parsed[k]);
+      }
+      begin = end;
     }
 
-    if (line.find(LineToKw) != std::string::npos) {
-      gf::Vector2f point;
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+
+    for (std::size_t k = 0; k < parts; ++k) {
+      storeRecords(store, parsed[k]);
+    }
+
+    std::memmove(buffer.data(), buffer.data() + complete, size - complete);
+    size -= complete;
+  }
+}
+
+/*
+ * records handed over by turtle --shm, see turtle-output.h for the layout
+ */
+
+static constexpr const char *ShmKw = "Shm";
+
+#if defined(__linux__)
+
+static constexpr const char *ShmMagic = "TRTLSHM1";
+static constexpr uint32_t ShmBatch = 256;
+static constexpr long ShmPollNanoseconds = 100000000;
+
+struct ShmHeader {
+  char magic[8];
+  uint32_t capacity;
+  uint32_t recordSize;
+  char pad0[48];
+  uint32_t head;
+  uint32_t done;
+  uint32_t readerWaiting;
+  char pad1[52];
+  uint32_t tail;
+  uint32_t writerWaiting;
+  uint32_t mapped;
+  char pad2[52];
+};
+
+static_assert(sizeof(ShmHeader) == 192, "the header of turtle --shm");
+
+struct ShmRecord {
+  uint32_t kind; // 0 for a move, 1 for a line, 2 for a color
+  uint32_t pad;
+  double values[3];
+};
+
+static_assert(sizeof(ShmRecord) == 32, "the records of turtle --shm");
+
+static uint32_t shmLoad(const uint32_t *word) {
+  return __atomic_load_n(word, __ATOMIC_SEQ_CST);
+}
+
+static void shmStore(uint32_t *word, uint32_t value) {
+  __atomic_store_n(word, value, __ATOMIC_SEQ_CST);
+}
+
+// false if it timed out
+static bool shmSleep(uint32_t *word, uint32_t value) {
+  struct timespec timeout = { 0, ShmPollNanoseconds };
+  return syscall(SYS_futex, word, FUTEX_WAIT, value, &timeout, nullptr, 0) == 0 || errno != ETIMEDOUT;
+}
+
+// turtle closed the pipe, the records it did not publish are lost
+static bool shmWriterGone(std::FILE *input) {
+  struct pollfd fd = { fileno(input), POLLIN, 0 };
+  return ::poll(&fd, 1, 0) > 0 && (fd.revents & (POLLHUP | POLLERR)) != 0;
+}
 
-      char *endptr = &line[0] + std::strlen(LineToKw);
-      point.x = std::strtod(endptr, &endptr);
-      point.y = std::strtod(endptr, &endptr);
+// read the records in place in the ring, turtle may still be writing them
+static bool loadShared(const char *name, std::FILE *input, RecordStore& store) {
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    return false;
+  }
+  shm_unlink(name); // the mappings keep it alive
 
-      commands.push_back(Command::LineTo);
-      points.push_back(point);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && static_cast<std::size_t>(st.st_size) >= sizeof(ShmHeader)) {
+    map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  auto header = static_cast<ShmHeader *>(map);
+  uint32_t capacity = header->capacity;
+  if (std::memcmp(header->magic, ShmMagic, 8) != 0
+      || header->recordSize != sizeof(ShmRecord)
+      || capacity == 0 || (capacity & (capacity - 1)) != 0
+      || static_cast<std::size_t>(st.st_size) < sizeof(ShmHeader) + capacity * sizeof(ShmRecord)) {
+    munmap(map, st.st_size);
+    return false;
+  }
 
-      ++movements;
+  // turtle stops waiting for a reader once it is set
+  shmStore(&header->mapped, 1);
+  syscall(SYS_futex, &header->mapped, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+  auto ring = reinterpret_cast<const ShmRecord *>(header + 1);
+  uint32_t mask = capacity - 1;
+  uint32_t tail = 0;
+  bool complete = true;
+
+  for (;;) {
+    uint32_t head = shmLoad(&header->head);
+    if (head == tail) {
+      shmStore(&header->readerWaiting, 1);
+      bool gone = false;
+      while (!gone && shmLoad(&header->head) == tail && !shmLoad(&header->done)) {
+        gone = !shmSleep(&header->head, tail) && shmWriterGone(input);
+      }
+      shmStore(&header->readerWaiting, 0);
+
+      // the wake up of done may be missed, and the last head is published
+      // before done, so both are looked at again
+      head = shmLoad(&header->head);
+      if (head == tail) {
+        complete = shmLoad(&header->done) != 0;
+        break;
+      }
     }
+
+    while (tail != head) {
+      const ShmRecord& record = ring[tail & mask];
+      if (record.kind == 2) {
+        store.addColor(gf::Color4f(record.values[0], record.values[1], record.values[2], 1.0f));
+      } else {
+        store.addPoint(record.kind == 0 ? Command::MoveTo : Command::LineTo, gf::Vector2f(record.values[0], record.values[1]));
+      }
+
+      if (++tail % ShmBatch == 0 || tail == head) {
+        shmStore(&header->tail, tail);
+        if (shmLoad(&header->writerWaiting)) {
+          syscall(SYS_futex, &header->tail, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+      }
+    }
+  }
+
+  munmap(map, st.st_size);
+  if (!complete) {
+    std::cerr << name << ": turtle stopped before the end of the drawing\n";
   }
+  return true;
+}
+
+#else
+
+static bool loadShared(const char *, std::FILE *, RecordStore&) {
+  return false;
+}
+
+#endif
+
+/*
+ * archives written by turtle --archive, see turtle-output.h for the layout
+ */
+
+static constexpr const char *ArchiveMagic = "TRTLARC1";
+static constexpr const char *ArchiveIndexMagic = "TRTLIDX1";
+static constexpr uint32_t ArchiveVersion = 1;
+static constexpr double ArchiveScale = 1e6;
+static constexpr std::size_t ArchiveHeaderSize = 16;
+static constexpr std::size_t ArchiveEntrySize = 72;
+static constexpr std::size_t ArchiveTrailerSize = 40;
+static constexpr std::size_t ArchiveMinMatch = 4;
+
+static uint64_t readLittleEndian(const uint8_t *bytes, std::size_t size) {
+  uint64_t value = 0;
+  for (std::size_t i = 0; i < size; ++i) {
+    value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+  }
+  return value;
+}
+
+// the compressed blocks stay in the file, the index tells where each one is
+// and the state of the turtle at its start, so that any of them can be
+// decoded without the previous ones
+class Archive {
+public:
+  struct Block {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t rawSize;
+    uint64_t firstRecord;
+    uint64_t firstStep;
+    int64_t x;
+    int64_t y;
+    int64_t color[3];
+  };
+
+  // read the header and the index, the file has to be seekable
+  bool open(std::FILE *file) {
+    uint8_t header[ArchiveHeaderSize];
+    uint8_t trailer[ArchiveTrailerSize];
+    if (std::fseek(file, 0, SEEK_END) != 0) {
+      return false;
+    }
+    long size = std::ftell(file);
+    if (size < static_cast<long>(ArchiveHeaderSize + ArchiveTrailerSize)
+        || !readAt(file, 0, header, sizeof(header))
+        || !readAt(file, size - ArchiveTrailerSize, trailer, sizeof(trailer))
+        || std::memcmp(header, ArchiveMagic, 8) != 0
+        || readLittleEndian(header + 8, 4) != ArchiveVersion
+        || std::memcmp(trailer + 32, ArchiveIndexMagic, 8) != 0) {
+      return false;
+    }
+
+    uint64_t indexOffset = readLittleEndian(trailer, 8);
+    uint64_t blockCount = readLittleEndian(trailer + 8, 8);
+    m_recordCount = readLittleEndian(trailer + 16, 8);
+    m_stepCount = readLittleEndian(trailer + 24, 8);
+    if (indexOffset < ArchiveHeaderSize || indexOffset > static_cast<uint64_t>(size)
+        || blockCount != (size - ArchiveTrailerSize - indexOffset) / ArchiveEntrySize
+        || indexOffset + blockCount * ArchiveEntrySize + ArchiveTrailerSize != static_cast<uint64_t>(size)) {
+      return false;
+    }
+
+    std::vector<uint8_t> index(blockCount * ArchiveEntrySize);
+    if (!readAt(file, indexOffset, index.data(), index.size())) {
+      return false;
+    }
+    m_blocks.resize(blockCount);
+    for (std::size_t i = 0; i < blockCount; ++i) {
+      const uint8_t *entry = index.data() + i * ArchiveEntrySize;
+      Block& block = m_blocks[i];
+      block.offset = readLittleEndian(entry, 8);
+      block.size = static_cast<uint32_t>(readLittleEndian(entry + 8, 4));
+      block.rawSize = static_cast<uint32_t>(readLittleEndian(entry + 12, 4));
+      block.firstRecord = readLittleEndian(entry + 16, 8);
+      block.firstStep = readLittleEndian(entry + 24, 8);
+      block.x = static_cast<int64_t>(readLittleEndian(entry + 32, 8));
+      block.y = static_cast<int64_t>(readLittleEndian(entry + 40, 8));
+      for (std::size_t c = 0; c < 3; ++c) {
+        block.color[c] = static_cast<int64_t>(readLittleEndian(entry + 48 + 8 * c, 8));
+      }
+      // findBlock searches the blocks by their first step
+      if (block.offset + block.size > indexOffset || block.firstRecord > m_recordCount || block.firstStep > m_stepCount
+          || (i > 0 && (block.firstRecord < m_blocks[i - 1].firstRecord || block.firstStep < m_blocks[i - 1].firstStep))) {
+        return false;
+      }
+    }
+
+    m_file = file;
+    return true;
+  }
+
+  std::size_t getBlockCount() const {
+    return m_blocks.size();
+  }
+
+  uint64_t getRecordCount() const {
+    return m_recordCount;
+  }
+
+  uint64_t getStepCount() const {
+    return m_stepCount;
+  }
+
+  // the last block starting at or before the step
+  std::size_t findBlock(uint64_t step) const {
+    auto it = std::upper_bound(m_blocks.begin(), m_blocks.end(), step, [](uint64_t value, const Block& block) {
+      return value < block.firstStep;
+    });
+    return it == m_blocks.begin() ? 0 : (it - m_blocks.begin()) - 1;
+  }
+
+  const Block& getBlock(std::size_t index) const {
+    return m_blocks[index];
+  }
+
+  // read the compressed bytes of a block, from one thread at a time
+  bool readBlock(std::size_t index, std::vector<uint8_t>& packed) const {
+    const Block& block = m_blocks[index];
+    packed.resize(block.size);
+    return readAt(m_file, block.offset, packed.data(), packed.size());
+  }
+
+  // decompress and decode a block on its own, safe on several threads
+  static bool decodeBlock(const Block& block, const std::vector<uint8_t>& packed, std::vector<Record>& records) {
+    std::vector<uint8_t> raw;
+    if (!decompress(packed, block.rawSize, raw)) {
+      return false;
+    }
+
+    int64_t x = block.x;
+    int64_t y = block.y;
+    int64_t color[3] = { block.color[0], block.color[1], block.color[2] };
+    const uint8_t *p = raw.data();
+    const uint8_t *end = p + raw.size();
+    records.clear();
+
+    while (p < end) {
+      Record record;
+      int64_t delta[3];
+      uint8_t kind = *p++;
+      std::size_t count = kind == 2 ? 3 : 2;
+      if (kind > 2) {
+        return false;
+      }
+      for (std::size_t i = 0; i < count; ++i) {
+        if (!readVarint(p, end, delta[i])) {
+          return false;
+        }
+      }
+      if (kind == 2) {
+        for (std::size_t c = 0; c < 3; ++c) {
+          color[c] = addDelta(color[c], delta[c]);
+        }
+        record.command = Command::Color;
+        record.color = gf::Color4f(color[0] / ArchiveScale, color[1] / ArchiveScale, color[2] / ArchiveScale, 1.0f);
+      } else {
+        x = addDelta(x, delta[0]);
+        y = addDelta(y, delta[1]);
+        record.command = kind == 0 ? Command::MoveTo : Command::LineTo;
+        record.point = gf::Vector2f(x / ArchiveScale, y / ArchiveScale);
+      }
+      records.push_back(record);
+    }
+    return true;
+  }
+
+private:
+  static bool readAt(std::FILE *file, uint64_t offset, uint8_t *bytes, std::size_t size) {
+    return std::fseek(file, static_cast<long>(offset), SEEK_SET) == 0 && std::fread(bytes, 1, size, file) == size;
+  }
+
+  static bool readVarint(const uint8_t *& p, const uint8_t *end, int64_t& value) {
+    uint64_t bits = 0;
+    for (unsigned shift = 0; p < end && shift < 64; shift += 7) {
+      uint8_t byte = *p++;
+      bits |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        value = unzigzag(bits);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool readLength(const uint8_t *& p, const uint8_t *end, std::size_t& length) {
+    if (length != 15) {
+      return true;
+    }
+    for (;;) {
+      if (p == end) {
+        return false;
+      }
+      uint8_t byte = *p++;
+      length += byte;
+      if (byte != 255) {
+        return true;
+      }
+    }
+  }
+
+  // the LZ77 sequences of turtle-archive.c
+  static bool decompress(const std::vector<uint8_t>& packed, std::size_t rawSize, std::vector<uint8_t>& raw) {
+    raw.resize(rawSize);
+    const uint8_t *p = packed.data();
+    const uint8_t *end = p + packed.size();
+    std::size_t out = 0;
+
+    while (p < end) {
+      uint8_t token = *p++;
+      std::size_t literals = token >> 4;
+      if (!readLength(p, end, literals) || literals > static_cast<std::size_t>(end - p) || literals > rawSize - out) {
+        return false;
+      }
+      std::memcpy(raw.data() + out, p, literals);
+      p += literals;
+      out += literals;
+      if (p == end) {
+        break;
+      }
+
+      if (end - p < 2) {
+        return false;
+      }
+      std::size_t offset = p[0] | p[1] << 8;
+      p += 2;
+      std::size_t length = token & 0xF;
+      if (!readLength(p, end, length)) {
+        return false;
+      }
+      length += ArchiveMinMatch;
+      if (offset == 0 || offset > out || length > rawSize - out) {
+        return false;
+      }
+      for (std::size_t i = 0; i < length; ++i, ++out) { // the match may overlap
+        raw[out] = raw[out - offset];
+      }
+    }
+
+    return out == rawSize;
+  }
+
+private:
+  std::FILE *m_file = nullptr;
+  std::vector<Block> m_blocks;
+  uint64_t m_recordCount = 0;
+  uint64_t m_stepCount = 0;
+};
+
+// read the blocks in order and decode them on the threads, then append them
+// to the store in order
+static bool loadArchive(const Archive& archive, RecordStore& store, std::size_t threads) {
+  std::vector<std::vector<uint8_t>> packed(threads);
+  std::vector<std::vector<Record>> decoded(threads);
+  std::vector<char> ok(threads);
+  std::vector<std::thread> workers;
+
+  auto decode = [&archive, &packed, &decoded, &ok](std::size_t block, std::size_t k) {
+    ok[k] = Archive::decodeBlock(archive.getBlock(block), packed[k], decoded[k]);
+  };
+
+  for (std::size_t first = 0; first < archive.getBlockCount(); first += threads) {
+    std::size_t count = std::min(threads, archive.getBlockCount() - first);
+    for (std::size_t k = 0; k < count; ++k) {
+      if (!archive.readBlock(first + k, packed[k])) {
+        return false;
+      }
+    }
+
+    for (std::size_t k = 0; k + 1 < count; ++k) {
+      workers.emplace_back(decode, first + k, k);
+    }
+    decode(first + count - 1, count - 1);
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+
+    for (std::size_t k = 0; k < count; ++k) {
+      if (!ok[k]) {
+        return false;
+      }
+      storeRecords(store, decoded[k]);
+    }
+  }
+
+  return true;
+}
+
+// the replay of an archive from a step: only the block holding the step is
+// decoded at first, from the pose and the color of its entry, the next ones
+// when the replay reaches them
+class ArchiveReplay {
+public:
+  ArchiveReplay(const Archive& archive, RecordStore& store)
+  : m_archive(&archive)
+  , m_store(&store)
+  {
+  }
+
+  // start the store with a move to the point after the step, in the color
+  // at that time, followed by the rest of the block
+  bool seek(uint64_t step) {
+    if (m_archive->getBlockCount() == 0) {
+      return true;
+    }
+
+    step = std::min(step, m_archive->getStepCount());
+    m_next = m_archive->findBlock(step);
+    const Archive::Block& block = m_archive->getBlock(m_next);
+    std::vector<Record> records;
+    if (!decodeNext(records)) {
+      return false;
+    }
+
+    gf::Vector2f point(block.x / ArchiveScale, block.y / ArchiveScale);
+    gf::Color4f color(block.color[0] / ArchiveScale, block.color[1] / ArchiveScale, block.color[2] / ArchiveScale, 1.0f);
+    uint64_t currStep = block.firstStep;
+    auto it = records.begin();
+    for (; it != records.end() && (it->command == Command::Color || currStep < step); ++it) {
+      if (it->command == Command::Color) {
+        color = it->color;
+      } else {
+        point = it->point;
+        ++currStep;
+      }
+    }
+
+    m_store->addColor(color);
+    m_store->addPoint(Command::MoveTo, point);
+    storeRecords(*m_store, std::vector<Record>(it, records.end()));
+    m_stepCount = m_archive->getStepCount() - step + 1;
+    return true;
+  }
+
+  // decode the next blocks until the store holds count points, or until the
+  // end of the archive
+  bool fill(std::size_t count) {
+    std::vector<Record> records;
+    while (m_store->getPointCount() < count && m_next < m_archive->getBlockCount()) {
+      if (!decodeNext(records)) {
+        return false;
+      }
+      storeRecords(*m_store, records);
+    }
+    return true;
+  }
+
+  // the steps of the replay, the first one is the move to the seeked point
+  std::size_t getStepCount() const {
+    return m_stepCount;
+  }
+
+private:
+  bool decodeNext(std::vector<Record>& records) {
+    std::size_t index = m_next++;
+    return m_archive->readBlock(index, m_packed) && Archive::decodeBlock(m_archive->getBlock(index), m_packed, records);
+  }
+
+private:
+  const Archive *m_archive;
+  RecordStore *m_store;
+  std::size_t m_next = 0;
+  std::size_t m_stepCount = 0;
+  std::vector<uint8_t> m_packed;
+};
+
+/*
+ * rendering
+ */
+
+static constexpr float LineWidth = 3.0f;
+static constexpr std::size_t BatchVertices = 6 * 16384;
+
+// a thick segment as two triangles
+static void appendSegment(gf::VertexArray& batch, gf::Vector2f p0, gf::Vector2f p1, gf::Color4f color) {
+  gf::Vector2f d = p1 - p0;
+  if (d.x == 0 && d.y == 0) {
+    return;
+  }
+  gf::Vector2f n = gf::perp(gf::normalize(d)) * (LineWidth / 2);
+
+  gf::Vertex vertices[4];
+  vertices[0].position = p0 + n;
+  vertices[1].position = p0 - n;
+  vertices[2].position = p1 + n;
+  vertices[3].position = p1 - n;
+  for (auto& vertex : vertices) {
+    vertex.color = color;
+  }
+
+  batch.append(vertices[0]);
+  batch.append(vertices[1]);
+  batch.append(vertices[2]);
+  batch.append(vertices[2]);
+  batch.append(vertices[1]);
+  batch.append(vertices[3]);
+}
+
+// the completed steps, drawn once in a texture kept between frames, so that
+// a frame only draws the steps completed since the previous one
+//
+// the texture is drawn again from the first step when the replay goes
+// backward or when the view or the size of the window change
+class Canvas {
+public:
+  explicit Canvas(const RecordStore& store)
+  : m_store(&store)
+  , m_cursor(store)
+  {
+  }
+
+  // draw the steps before step that are not in the texture yet
+  void advance(const gf::RenderWindow& renderer, const gf::View& view, std::size_t step) {
+    gf::Vector2i size = renderer.getSize();
+    if (!m_texture || size != m_size || view.getCenter() != m_center || view.getSize() != m_viewSize || step < m_step) {
+      restart(size, view);
+    }
+
+    gf::VertexArray batch(gf::PrimitiveType::Triangles);
+    bool drawn = false;
+    Record record;
+
+    while (m_step < step && m_cursor.next(record)) {
+      switch (record.command) {
+        case Command::Color:
+          m_color = record.color;
+          break;
+        case Command::MoveTo:
+          m_point = record.point;
+          ++m_step;
+          break;
+        case Command::LineTo:
+          appendSegment(batch, m_point, record.point, m_color);
+          m_point = record.point;
+          ++m_step;
+          break;
+      }
+
+      if (batch.getVertexCount() >= BatchVertices) {
+        m_texture->draw(batch);
+        batch.clear();
+        drawn = true;
+      }
+    }
+
+    if (batch.getVertexCount() > 0) {
+      m_texture->draw(batch);
+      drawn = true;
+    }
+
+    if (drawn) {
+      m_texture->display();
+    }
+  }
+
+  const gf::Texture& getTexture() const {
+    return m_texture->getTexture();
+  }
+
+  // the records after the last step drawn in the texture
+  const RecordStore::Cursor& getCursor() const {
+    return m_cursor;
+  }
+
+  // the position and the color after the last step drawn in the texture
+  gf::Vector2f getPoint() const {
+    return m_point;
+  }
+
+  gf::Color4f getColor() const {
+    return m_color;
+  }
+
+private:
+  void restart(gf::Vector2i size, const gf::View& view) {
+    if (!m_texture || size != m_size) {
+      m_texture.reset(new gf::RenderTexture(size));
+      m_size = size;
+    }
+    m_center = view.getCenter();
+    m_viewSize = view.getSize();
+
+    m_texture->setView(view);
+    m_texture->clear(gf::Color::White);
+    m_texture->display();
+
+    m_cursor = RecordStore::Cursor(*m_store);
+    m_step = 0;
+    m_point = gf::Vector2f(0, 0);
+    m_color = gf::Color::Black;
+  }
+
+private:
+  const RecordStore *m_store;
+  std::unique_ptr<gf::RenderTexture> m_texture;
+  gf::Vector2i m_size;
+  gf::Vector2f m_center;
+  gf::Vector2f m_viewSize;
+
+  RecordStore::Cursor m_cursor;
+  std::size_t m_step = 0;
+  gf::Vector2f m_point;
+  gf::Color4f m_color = gf::Color::Black;
+};
+
+static void usage(const char *prog) {
+  std::cerr << "usage: " << prog << " [--step N] [FILE]\n"
+      "  FILE        output of turtle, as text or written with --archive\n"
+      "              (default: standard input, as text or from turtle --shm)\n"
+      "  --step N    start the replay at the step N, an archive is only\n"
+      "              decoded from the block holding it, the steps before\n"
+      "              are not drawn\n";
+}
+
+int main(int argc, char *argv[]) {
+  const char *path = nullptr;
+  std::size_t startStep = 0;
+
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--step") == 0 && i + 1 < argc) {
+      startStep = std::strtoull(argv[++i], nullptr, 10);
+    } else if (argv[i][0] != '-' && path == nullptr) {
+      path = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::FILE *input = stdin;
+  if (path != nullptr) {
+    input = std::fopen(path, "rb");
+    if (input == nullptr) {
+      std::perror(path);
+      return 1;
+    }
+  }
+
+  RecordStore store;
+  std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+  Archive archive;
+  std::unique_ptr<ArchiveReplay> replay;
+
+  int first = std::getc(input);
+  if (first == ArchiveMagic[0]) {
+    bool valid = archive.open(input);
+    if (valid && startStep > 0) {
+      replay.reset(new ArchiveReplay(archive, store));
+      valid = replay->seek(startStep);
+      startStep = 0; // the store starts at it
+    } else if (valid) {
+      valid = loadArchive(archive, store, threads);
+    }
+    if (!valid) {
+      std::cerr << (path ? path : "stdin") << ": not a valid archive\n";
+      return 1;
+    }
+  } else if (first == ShmKw[0]) {
+    // turtle --shm names the region on the first line, nothing follows it
+    std::ungetc(first, input);
+    char line[256];
+    char name[256];
+    if (std::fgets(line, sizeof(line), input) == nullptr
+        || !startsWith(line, line + std::strlen(line), ShmKw)
+        || std::sscanf(line + std::strlen(ShmKw), "%255s", name) != 1
+        || !loadShared(name, input, store)) {
+      std::cerr << "the shared memory of turtle --shm can not be read\n";
+      return 1;
+    }
+  } else {
+    if (first != EOF) {
+      std::ungetc(first, input);
+    }
+    loadRecords(input, store, threads);
+  }
+
+  // the replay reads the next blocks of the archive from it
+  if (input != stdin && !replay) {
+    std::fclose(input);
+  }
+
+  std::size_t movements = replay ? replay->getStepCount() : store.getPointCount();
+
+  std::cerr << store.getCommandCount() << " records in " << store.getMemoryUsage() << " bytes ("
+      << store.getVectorUsage() << " bytes with one vector per kind)\n";
 
   static constexpr gf::Vector2u ScreenSize(1024, 576);
   static constexpr gf::Vector2f ViewSize(1000.0f, 1000.0f);
@@ -92,6 +1277,9 @@ int main() {
   gf::ExtendView mainView(ViewCenter, ViewSize);
   views.addView(mainView);
 
+  gf::ScreenView screenView;
+  views.addView(screenView);
+
   views.setInitialFramebufferSize(ScreenSize);
 
   // actions
@@ -125,9 +1313,11 @@ int main() {
   renderer.clear(gf::Color::White);
   gf::Clock clock;
 
+  Canvas canvas(store);
+
   static constexpr float Duration = 10.0f;
   static constexpr float Jump = 1.0f; // for forward and backward
-  float elapsed = 0;
+  float elapsed = movements > 0 ? std::min(startStep, movements) * Duration / movements : 0.0f;
 
   while (window.isOpen()) {
     // 1. input
@@ -171,52 +1361,48 @@ int main() {
     renderer.clear();
     renderer.setView(mainView);
 
-    if (!commands.empty()) {
+    if (store.getCommandCount() > 0) {
       float steps = elapsed / Duration * movements;
       std::size_t maxStep = std::floor(steps);
       float inStep = std::fmod(steps, 1.0f);
 
-      gf::Vector2f currPoint(0, 0);
-      gf::Color4f currColor = gf::Color::Black;
+      // up to the step in progress
+      if (replay && !replay->fill(maxStep + 1)) {
+        std::cerr << (path ? path : "stdin") << ": not a valid archive\n";
+        return 1;
+      }
 
-      auto itPoint = points.begin();
-      auto itColor = colors.begin();
+      canvas.advance(renderer, mainView, maxStep);
 
-      std::size_t currStep = 0;
+      renderer.setView(screenView);
+      renderer.draw(gf::Sprite(canvas.getTexture()));
+      renderer.setView(mainView);
 
-      for (auto cmd : commands) {
-        if (currStep > maxStep) {
-          break;
-        }
+      // the step in progress, on top of the texture
 
-        switch (cmd) {
-          case Command::Color:
-            currColor = *itColor++;
-            break;
-          case Command::MoveTo:
-            currPoint = *itPoint++;
-            break;
-          case Command::LineTo: {
-            gf::Vector2f nextPoint = *itPoint++;
-
-            if (currStep == maxStep) {
-              nextPoint = gf::lerp(currPoint, nextPoint, inStep);
-            }
-
-            gf::Line line(currPoint, nextPoint);
-            line.setColor(currColor);
-            line.setWidth(3.0f);
-            renderer.draw(line);
-
-            currPoint = nextPoint;
-            break;
-          }
-        }
+      gf::Vector2f currPoint = canvas.getPoint();
+      gf::Color4f currColor = canvas.getColor();
 
+      RecordStore::Cursor cursor = canvas.getCursor();
+      Record record;
 
-        if (cmd != Command::Color) {
-          ++currStep;
+      while (cursor.next(record)) {
+        if (record.command == Command::Color) {
+          currColor = record.color;
+          continue;
         }
+
+        if (record.command == Command::LineTo) {
+          gf::Vector2f nextPoint = gf::lerp(currPoint, record.point, inStep);
+          gf::VertexArray batch(gf::PrimitiveType::Triangles);
+          appendSegment(batch, currPoint, nextPoint, currColor);
+          renderer.draw(batch);
+          currPoint = nextPoint;
+        } else {
+          currPoint = record.point;
+        }
+
+        break;
       }
 
       gf::CircleShape turtle(5.0f);
@@ -232,5 +1418,9 @@ int main() {
     actions.reset();
   }
 
+  if (input != stdin && replay) {
+    std::fclose(input);
+  }
+
   return 0;
 }
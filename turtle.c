@@ -1,35 +1,421 @@
 #include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "turtle-ast.h"
+#include "turtle-budget.h"
+#include "turtle-instance.h"
+#include "turtle-jit.h"
 #include "turtle-lexer.h"
+#include "turtle-metrics.h"
+#include "turtle-output.h"
 #include "turtle-parser.h"
 
-int main() {
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options] < program.turtle\n"
+          "  --simplify          drop duplicate segments, merge collinear "
+          "lines and\n"
+          "                      elide no-op moves and colors\n"
+          "  --raster FILE       render to a PNG or PPM image instead of "
+          "text\n"
+          "  --size WxH          size of the image (default 1024x1024)\n"
+          "  --line-width N      width of the lines (default 2)\n"
+          "  --threads N         rendering threads (default one per core)\n"
+          "  --svg FILE          write an SVG image instead of text, - for "
+          "stdout\n"
+          "  --precision N       decimals kept in the SVG (default 2)\n"
+          "  --archive FILE      write a block-compressed replay archive "
+          "instead of\n"
+          "                      text, - for stdout\n"
+          "  --shm               hand the records to turtle-viewer through "
+          "shared\n"
+          "                      memory instead of text when the output is "
+          "a pipe\n"
+          "  --pipeline N        format and write the output on another "
+          "thread,\n"
+          "                      through a ring of N records (default 0, "
+          "off)\n"
+          "  --stats             write the extent, the number of segments, "
+          "their\n"
+          "                      length and their colors as JSON instead of "
+          "the\n"
+          "                      drawing\n"
+          "  --jobs N            evaluate independent top-level sections on N\n"
+          "                      threads, and draw and format the records of "
+          "the\n"
+          "                      long repeats that only move the turtle on "
+          "them,\n"
+          "                      0 for one per core (default 1)\n"
+          "  --stream            evaluate each top-level command as soon as it "
+          "is\n"
+          "                      parsed and free it, for large generated "
+          "programs\n"
+          "  --no-optimize       evaluate the program as written, without "
+          "folding\n"
+          "                      constants or caching values in the loops\n"
+          "  --instancing        replay the drawing of the procedures that "
+          "only\n"
+          "                      depend on the pose of the turtle instead of\n"
+          "                      evaluating them again, the last digit of a\n"
+          "                      coordinate may differ\n"
+          "  --no-jit            interpret hot repeat bodies instead of "
+          "compiling\n"
+          "                      them to native code\n"
+          "  --max-nodes N       stop the program after N evaluated nodes\n"
+          "  --max-segments N    stop the program after N drawn lines\n"
+          "  --max-bytes N       stop the program once N bytes are written\n"
+          "  --max-depth N       stop the program beyond N nested calls\n"
+          "  --timeout S         stop the program after S seconds of "
+          "evaluation\n"
+          "                      (no limit by default, any of them disables "
+          "the\n"
+          "                      native code and --instancing)\n"
+          "  --metrics FILE      write runtime metrics on exit, - for stderr\n"
+          "  --metrics-format F  json (default) or openmetrics\n"
+          "  --trace FILE        write Chrome trace events of the phases and "
+          "of\n"
+          "                      the top-level calls\n",
+          prog);
+}
+
+static void print_simplify_stats(const struct output_simplify_stats *stats) {
+  fprintf(stderr,
+          "simplify: %zu records in, %zu out (%zu duplicate segments, "
+          "%zu merged segments, %zu moves, %zu colors removed)\n",
+          stats->records_in, stats->records_out, stats->duplicate_segments,
+          stats->merged_segments, stats->elided_moves, stats->elided_colors);
+}
+
+// the output chain selected by the options, NULL if it can not be created
+static struct output *create_output(const struct output_raster_options *raster,
+                                    const struct output_svg_options *svg,
+                                    const char *archive, bool shm,
+                                    bool stats, bool simplify, size_t pipeline,
+                                    struct output **simplifier) {
+  struct output *out = NULL;
+  if (raster->path) {
+    out = output_raster_create(raster);
+  } else if (svg->path) {
+    out = output_svg_create(svg);
+  } else if (archive) {
+    out = output_archive_create(archive);
+  } else if (stats) {
+    out = output_stats_create();
+  } else {
+    out = shm ? output_shm_create(stdout) : NULL;
+    if (!out) {
+      out = output_text_create(stdout);
+    }
+  }
+  *simplifier = NULL;
+  if (out && simplify) {
+    *simplifier = output_simplify_create(out);
+    out = *simplifier;
+  }
+  if (out && pipeline > 0) {
+    out = output_pipeline_create(out, pipeline);
+  }
+  return out;
+}
+
+int main(int argc, char *argv[]) {
+  bool simplify = false;
+  struct output_raster_options raster = {
+      .path = NULL,
+      .width = 1024,
+      .height = 1024,
+      .line_width = 2,
+      .threads = 0,
+  };
+  struct output_svg_options svg = {
+      .path = NULL,
+      .precision = 2,
+  };
+
+  const char *archive = NULL;
+  bool shm = false;
+  bool stats = false;
+  size_t pipeline = 0;
+
+  const char *metrics_path = NULL;
+  enum metrics_format metrics_format = METRICS_JSON;
+  const char *trace_path = NULL;
+  unsigned jobs = 1;
+  bool jit = true;
+  bool instancing = false;
+  bool optimize = true;
+  bool stream = false;
+  struct budget budget;
+  budget_create(&budget);
+
+  for (int i = 1; i < argc; ++i) {
+    const char *arg = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+    if (strcmp(arg, "--simplify") == 0) {
+      simplify = true;
+    } else if (strcmp(arg, "--raster") == 0 && val) {
+      raster.path = val;
+      ++i;
+    } else if (strcmp(arg, "--svg") == 0 && val) {
+      svg.path = val;
+      ++i;
+    } else if (strcmp(arg, "--archive") == 0 && val) {
+      archive = val;
+      ++i;
+    } else if (strcmp(arg, "--shm") == 0) {
+      shm = true;
+    } else if (strcmp(arg, "--pipeline") == 0 && val &&
+               sscanf(val, "%zu", &pipeline) == 1) {
+      ++i;
+    } else if (strcmp(arg, "--stats") == 0) {
+      stats = true;
+    } else if (strcmp(arg, "--precision") == 0 && val &&
+               sscanf(val, "%d", &svg.precision) == 1 && svg.precision >= 0 &&
+               svg.precision <= 9) {
+      ++i;
+    } else if (strcmp(arg, "--size") == 0 && val &&
+               sscanf(val, "%ux%u", &raster.width, &raster.height) == 2 &&
+               raster.width > 0 && raster.height > 0) {
+      ++i;
+    } else if (strcmp(arg, "--line-width") == 0 && val &&
+               sscanf(val, "%lf", &raster.line_width) == 1 &&
+               raster.line_width > 0) {
+      ++i;
+    } else if (strcmp(arg, "--jobs") == 0 && val &&
+               sscanf(val, "%u", &jobs) == 1) {
+      ++i;
+    } else if (strcmp(arg, "--stream") == 0) {
+      stream = true;
+    } else if (strcmp(arg, "--no-optimize") == 0) {
+      optimize = false;
+    } else if (strcmp(arg, "--instancing") == 0) {
+      instancing = true;
+    } else if (strcmp(arg, "--no-jit") == 0) {
+      jit = false;
+    } else if (strcmp(arg, "--max-nodes") == 0 && val &&
+               sscanf(val, "%" SCNu64, &budget.max_nodes) == 1) {
+      ++i;
+    } else if (strcmp(arg, "--max-segments") == 0 && val &&
+               sscanf(val, "%" SCNu64, &budget.max_segments) == 1) {
+      ++i;
+    } else if (strcmp(arg, "--max-bytes") == 0 && val &&
+               sscanf(val, "%zu", &budget.max_bytes) == 1) {
+      ++i;
+    } else if (strcmp(arg, "--max-depth") == 0 && val &&
+               sscanf(val, "%zu", &budget.max_call_depth) == 1) {
+      ++i;
+    } else if (strcmp(arg, "--timeout") == 0 && val &&
+               sscanf(val, "%lf", &budget.timeout) == 1 &&
+               budget.timeout > 0) {
+      ++i;
+    } else if (strcmp(arg, "--metrics") == 0 && val) {
+      metrics_path = val;
+      ++i;
+    } else if (strcmp(arg, "--metrics-format") == 0 && val &&
+               (strcmp(val, "json") == 0 || strcmp(val, "openmetrics") == 0)) {
+      metrics_format =
+          strcmp(val, "json") == 0 ? METRICS_JSON : METRICS_OPENMETRICS;
+      ++i;
+    } else if (strcmp(arg, "--trace") == 0 && val) {
+      trace_path = val;
+      ++i;
+    } else if (strcmp(arg, "--threads") == 0 && val &&
+               sscanf(val, "%u", &raster.threads) == 1) {
+      ++i;
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if ((raster.path != NULL) + (svg.path != NULL) + (archive != NULL) + shm >
+      1) {
+    fprintf(stderr,
+            "--raster, --svg, --archive and --shm can not be used together\n");
+    return 1;
+  }
+  if (stats &&
+      (raster.path || svg.path || archive || shm || simplify || pipeline)) {
+    fprintf(stderr, "--stats can not be used with --raster, --svg, --archive, "
+                    "--shm, --simplify or --pipeline\n");
+    return 1;
+  }
+  // the bytes are counted by the writer thread
+  if (budget.max_bytes > 0 && pipeline > 0) {
+    fprintf(stderr, "--max-bytes and --pipeline can not be used together\n");
+    return 1;
+  }
+  if (stream && jobs != 1) {
+    fprintf(stderr, "--stream and --jobs can not be used together\n");
+    return 1;
+  }
+  svg.line_width = raster.line_width;
+  if (jobs == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = online > 0 ? online : 1;
+  }
+
+  struct metrics metrics;
+  bool instrumented = metrics_path || trace_path;
+  if (instrumented && !metrics_create(&metrics, trace_path)) {
+    return 1;
+  }
+
   srand(time(NULL));
 
+  struct context ctx;
+  context_create(&ctx);
+  ctx.threads = jobs;
+  if (!jit) {
+    jit_destroy(ctx.jit);
+    ctx.jit = NULL;
+  }
+  // a closed form with --stats would only be recorded once
+  if (instancing && !stats) {
+    ctx.instances = instances_create();
+  }
+  bool budgeted = budget.max_nodes > 0 || budget.max_segments > 0 ||
+                  budget.max_bytes > 0 || budget.max_call_depth > 0 ||
+                  budget.timeout > 0;
+  if (budgeted) {
+    budget_attach(&budget, &ctx);
+  }
+  if (instrumented) {
+    metrics_attach(&metrics, &ctx);
+  }
+
   struct ast root;
+  ast_create(&root);
+  struct output *simplifier = NULL;
+  if (stream) {
+    // the first command is evaluated before the end of the parsing
+    struct output *out =
+        create_output(&raster, &svg, archive, shm, stats, simplify, pipeline,
+                      &simplifier);
+    if (!out) {
+      context_destroy(&ctx);
+      if (instrumented) {
+        metrics_destroy(&metrics);
+      }
+      return 1;
+    }
+    context_set_output(&ctx, out);
+    ctx.stats = stats ? out : NULL;
+    root.stream = &ctx;
+    root.optimize = optimize;
+  }
+
+  enum metrics_phase phase = stream ? PHASE_EVAL : PHASE_PARSE;
+  if (stream) {
+    budget_start(&budget);
+  }
+  if (instrumented) {
+    metrics_phase_begin(&metrics, phase);
+  }
+
   int ret = yyparse(&root);
 
-  if (ret != 0) {
+  if (instrumented) {
+    metrics_phase_end(&metrics, phase);
+  }
+
+  if (ret != 0 && !stream) {
+    ast_destroy(&root);
+    context_destroy(&ctx);
+    if (instrumented) {
+      metrics_destroy(&metrics);
+    }
     return ret;
   }
 
   yylex_destroy();
 
-  assert(root.unit);
+  if (!stream) {
+    assert(root.unit);
 
-  struct context ctx;
-  context_create(&ctx);
+    if (optimize) {
+      if (instrumented) {
+        metrics_phase_begin(&metrics, PHASE_OPTIMIZE);
+      }
+      ast_optimize(&root);
+      if (instrumented) {
+        metrics_phase_end(&metrics, PHASE_OPTIMIZE);
+      }
+    }
 
-  // ast_print(&root);
-  ast_eval(&root, &ctx);
+    struct output *out =
+        create_output(&raster, &svg, archive, shm, stats, simplify, pipeline,
+                      &simplifier);
+    if (!out) {
+      ast_destroy(&root);
+      context_destroy(&ctx);
+      if (instrumented) {
+        metrics_destroy(&metrics);
+      }
+      return 1;
+    }
+    context_set_output(&ctx, out);
+    ctx.stats = stats ? out : NULL;
+
+    // ast_print(&root);
+    budget_start(&budget);
+    if (instrumented) {
+      metrics_phase_begin(&metrics, PHASE_EVAL);
+    }
+    if (jobs == 1) {
+      ast_eval(&root, &ctx);
+    } else {
+      ast_eval_parallel(&root, &ctx, jobs);
+    }
+    if (instrumented) {
+      metrics_phase_end(&metrics, PHASE_EVAL);
+    }
+  }
+
+  if (instrumented) {
+    metrics_phase_begin(&metrics, PHASE_OUTPUT);
+  }
+  if (!output_finish(ctx.out)) {
+    ret = 1;
+  }
+  if (instrumented) {
+    metrics_phase_end(&metrics, PHASE_OUTPUT);
+  }
+
+  if (simplifier) {
+    print_simplify_stats(output_simplify_stats(simplifier));
+  }
+  if (ctx.stats) {
+    output_stats_write(ctx.stats, stdout);
+  }
 
   if (ctx.error) {
     ret = 1;
   }
 
+  if (metrics_path) {
+    FILE *file = strcmp(metrics_path, "-") == 0 ? stderr
+                                                : fopen(metrics_path, "w");
+    if (file) {
+      metrics_write(&metrics, ctx.out, metrics_format, file);
+      if (file != stderr) {
+        fclose(file);
+      }
+    } else {
+      perror(metrics_path);
+      ret = 1;
+    }
+  }
+  if (instrumented) {
+    metrics_destroy(&metrics);
+  }
+
   ast_destroy(&root);
   context_destroy(&ctx);
 